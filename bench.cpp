@@ -0,0 +1,301 @@
+// Throughput benchmarks for the engines in main.cpp.
+// Configure with -DCMAKE_BUILD_TYPE=Release, then run
+// `Assignment_2_bench [name]` to run one benchmark or all of them.
+#define ASSIGNMENT_NO_MAIN
+#include "main.cpp"
+
+#include <chrono>
+#include <iomanip>
+#include <random>
+
+typedef chrono::steady_clock Clock;
+
+volatile long long sink;
+
+double secondsSince(Clock::time_point start)
+{
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(const string &name, long long operations, double seconds)
+{
+    cout << left << setw(40) << name << right << fixed << setprecision(2)
+         << setw(10) << operations / seconds / 1e6 << " Mops/s" << endl;
+}
+
+vector<Item> randomItems(int count, unsigned seed)
+{
+    mt19937 rng(seed);
+    vector<Item> items;
+    items.reserve(count);
+    for (int i = 0; i < count; ++i)
+        items.push_back(Item("item" + to_string(rng()), "category" + to_string(i % 16), static_cast<int>(rng() % 1000000)));
+    return items;
+}
+
+template <int Arity>
+void benchHeapPop(const vector<Item> &items)
+{
+    Heap<ByPrice, Ascending, Arity> heap;
+    heap.reserve(items.size());
+    heap.buildFrom(items.begin(), items.end());
+
+    long long checksum = 0;
+    auto start = Clock::now();
+    while (heap.size())
+    {
+        checksum += heap.top().price;
+        heap.remove();
+    }
+    report("Heap pop, arity " + to_string(Arity), items.size(), secondsSince(start));
+    sink = checksum;
+}
+
+template <int Arity>
+void benchHandleHeapPop(vector<Item> items)
+{
+    HandleHeap<ByPrice, Ascending, Arity> heap(items);
+    for (uint32_t i = 0; i < items.size(); ++i)
+        heap.add(i);
+
+    long long checksum = 0;
+    auto start = Clock::now();
+    while (heap.size())
+    {
+        checksum += heap.topIndex();
+        heap.remove();
+    }
+    report("HandleHeap pop, arity " + to_string(Arity), items.size(), secondsSince(start));
+    sink = checksum;
+}
+
+void benchHeaps()
+{
+    vector<Item> items = randomItems(1 << 20, 1);
+    benchHeapPop<2>(items);
+    benchHeapPop<4>(items);
+    benchHeapPop<8>(items);
+    benchHandleHeapPop<2>(items);
+    benchHandleHeapPop<4>(items);
+    benchHandleHeapPop<8>(items);
+}
+
+// Starts threads together and times them until the last one finishes.
+template <class Body>
+double runThreads(int threads, Body body)
+{
+    atomic<int> ready(0);
+    atomic<bool> go(false);
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back([&, t]
+                             {
+            ++ready;
+            while (!go.load())
+                this_thread::yield();
+            body(t); });
+
+    while (ready.load() < threads)
+        this_thread::yield();
+    auto start = Clock::now();
+    go.store(true);
+    for (auto &worker : workers)
+        worker.join();
+    return secondsSince(start);
+}
+
+// Every thread alternates add and remove on a queue prefilled with
+// PrefillPerThread items per thread, so shards stay populated.
+template <class Queue, class Add, class Remove>
+double runQueueThreads(Queue &queue, int threads, int opsPerThread, Add add, Remove remove)
+{
+    const int PrefillPerThread = 1 << 12;
+    mt19937 rng(threads);
+    for (int i = 0; i < threads * PrefillPerThread; ++i)
+        add(queue, Item("prefill", "c", static_cast<int>(rng() % 1000000)));
+
+    return runThreads(threads, [&](int t)
+                      {
+        mt19937 local(t + 1);
+        Item item("", "", 0);
+        long long checksum = 0;
+        for (int i = 0; i < opsPerThread; ++i)
+        {
+            if (i % 2 == 0)
+                add(queue, Item("item", "c", static_cast<int>(local() % 1000000)));
+            else if (remove(queue, item))
+                checksum += item.price;
+        }
+        sink = checksum; });
+}
+
+void benchMultiQueue()
+{
+    const int OpsPerThread = 1 << 19;
+    for (int threads : {1, 2, 4, 8, 16})
+    {
+        MultiQueue<ByPrice> multiQueue(threads);
+        double seconds = runQueueThreads(
+            multiQueue, threads, OpsPerThread,
+            [](MultiQueue<ByPrice> &queue, Item item)
+            { queue.add(std::move(item)); },
+            [](MultiQueue<ByPrice> &queue, Item &item)
+            { return queue.tryRemove(item); });
+        report("MultiQueue, " + to_string(threads) + " threads", 1LL * threads * OpsPerThread, seconds);
+
+        struct LockedHeap
+        {
+            mutex lock;
+            Heap<ByPrice> heap;
+        } locked;
+        seconds = runQueueThreads(
+            locked, threads, OpsPerThread,
+            [](LockedHeap &queue, Item item)
+            {
+                lock_guard<mutex> guard(queue.lock);
+                queue.heap.add(std::move(item));
+            },
+            [](LockedHeap &queue, Item &item)
+            {
+                lock_guard<mutex> guard(queue.lock);
+                if (!queue.heap.size())
+                    return false;
+                item = queue.heap.top();
+                queue.heap.remove();
+                return true;
+            });
+        report("Mutex + Heap, " + to_string(threads) + " threads", 1LL * threads * OpsPerThread, seconds);
+    }
+}
+
+// Steady-state churn: a tree of Live items retires its oldest batch and
+// inserts a fresh one, so removes match inserts one for one. Both phases
+// are timed separately to compare their per-operation cost.
+void benchChurn()
+{
+    const int Live = 1 << 16;
+    const int Batch = 1 << 12;
+    const int Batches = 256;
+    vector<Item> items = randomItems(Live + Batch * Batches, 2);
+
+    AVL tree;
+    for (int i = 0; i < Live; ++i)
+        tree.add(items[i]);
+
+    double insertSeconds = 0, removeSeconds = 0;
+    for (int batch = 0; batch < Batches; ++batch)
+    {
+        auto start = Clock::now();
+        for (int i = batch * Batch; i < (batch + 1) * Batch; ++i)
+            tree.remove(items[i]);
+        removeSeconds += secondsSince(start);
+
+        start = Clock::now();
+        for (int i = Live + batch * Batch; i < Live + (batch + 1) * Batch; ++i)
+            tree.add(items[i]);
+        insertSeconds += secondsSince(start);
+    }
+    report("AVL churn remove", 1LL * Batch * Batches, removeSeconds);
+    report("AVL churn insert", 1LL * Batch * Batches, insertSeconds);
+    report("AVL churn remove + insert", 2LL * Batch * Batches, removeSeconds + insertSeconds);
+    sink = tree.aggregate().count;
+}
+
+// Threads look up random keys and, once every ReadsPerWrite lookups, add
+// or remove one, over a key space prefilled to half occupancy.
+template <class Map, class Find, class Update>
+double runMapThreads(Map &map, const vector<string> &names, int threads, int opsPerThread, Find find, Update update)
+{
+    const int ReadsPerWrite = 50;
+    for (size_t i = 0; i < names.size(); i += 2)
+        update(map, names[i], true);
+
+    return runThreads(threads, [&](int t)
+                      {
+        mt19937 local(t + 1);
+        long long hits = 0;
+        for (int i = 0; i < opsPerThread; ++i)
+        {
+            const string &name = names[local() % names.size()];
+            if (i % (ReadsPerWrite + 1) == ReadsPerWrite)
+                update(map, name, (i / (ReadsPerWrite + 1)) % 2 == 0);
+            else
+                hits += find(map, name);
+        }
+        sink = hits; });
+}
+
+void benchConcurrentAVL()
+{
+    const int Keys = 1 << 16;
+    const int OpsPerThread = 1 << 19;
+    vector<string> names;
+    for (int i = 0; i < Keys; ++i)
+        names.push_back("item" + to_string(i));
+
+    for (int threads : {1, 2, 4, 8, 16})
+    {
+        ConcurrentAVL concurrent;
+        double seconds = runMapThreads(
+            concurrent, names, threads, OpsPerThread,
+            [](ConcurrentAVL &map, const string &name)
+            { return map.contains(name); },
+            [](ConcurrentAVL &map, const string &name, bool add)
+            {
+                if (add)
+                    map.add(Item(name, "c", 1));
+                else
+                    map.remove(name);
+            });
+        report("ConcurrentAVL 50:1, " + to_string(threads) + " threads", 1LL * threads * OpsPerThread, seconds);
+
+        struct LockedAVL
+        {
+            mutex lock;
+            AVL tree;
+        } locked;
+        seconds = runMapThreads(
+            locked, names, threads, OpsPerThread,
+            [](LockedAVL &map, const string &name)
+            {
+                lock_guard<mutex> guard(map.lock);
+                auto found = map.tree.lower_bound(name);
+                return found != map.tree.end() && found->itemName == name;
+            },
+            [](LockedAVL &map, const string &name, bool add)
+            {
+                lock_guard<mutex> guard(map.lock);
+                if (add)
+                    map.tree.add(Item(name, "c", 1));
+                else
+                    map.tree.remove(Item(name, "c", 1));
+            });
+        report("Mutex + AVL 50:1, " + to_string(threads) + " threads", 1LL * threads * OpsPerThread, seconds);
+    }
+}
+
+struct Benchmark
+{
+    const char *name;
+    void (*run)();
+};
+
+int main(int argc, char **argv)
+{
+    const Benchmark benchmarks[] = {
+        {"heap", benchHeaps},
+        {"multiqueue", benchMultiQueue},
+        {"churn", benchChurn},
+        {"concurrentavl", benchConcurrentAVL},
+    };
+
+    string only = argc > 1 ? argv[1] : "";
+    for (const auto &benchmark : benchmarks)
+    {
+        if (!only.empty() && only != benchmark.name)
+            continue;
+        cout << "== " << benchmark.name << " ==" << endl;
+        benchmark.run();
+    }
+    return 0;
+}
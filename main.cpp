@@ -3,6 +3,19 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 
 using namespace std;
 
@@ -31,326 +44,3602 @@ public:
     }
 };
 
+struct ByName
+{
+    static const string &key(const Item &item) { return item.itemName; }
+};
+
+struct ByPrice
+{
+    static int key(const Item &item) { return item.price; }
+};
+
+struct ByCategory
+{
+    static const string &key(const Item &item) { return item.category; }
+};
+
+struct Descending;
+
+struct Ascending
+{
+    typedef Descending Reverse;
+
+    template <class T>
+    static bool before(const T &a, const T &b) { return a < b; }
+};
+
+struct Descending
+{
+    typedef Ascending Reverse;
+
+    template <class T>
+    static bool before(const T &a, const T &b) { return a > b; }
+};
+
+template <class Key, class Order, class Items>
+void siftIndexDown(const Items &items, vector<int> &indices, int index, int count)
+{
+    int moving = indices[index];
+    int child;
+    while ((child = 2 * index + 1) < count)
+    {
+        if (child + 1 < count && Order::before(Key::key(items[indices[child]]), Key::key(items[indices[child + 1]])))
+            ++child;
+        if (!Order::before(Key::key(items[moving]), Key::key(items[indices[child]])))
+            break;
+        indices[index] = indices[child];
+        index = child;
+    }
+    indices[index] = moving;
+}
+
+template <class Key, class Order, class Items>
+vector<int> sortedIndicesBy(const Items &items)
+{
+    int count = items.size();
+    vector<int> indices(count);
+    for (int i = 0; i < count; ++i)
+        indices[i] = i;
+
+    for (int i = count / 2 - 1; i >= 0; --i)
+        siftIndexDown<Key, Order>(items, indices, i, count);
+
+    for (int end = count - 1; end > 0; --end)
+    {
+        swap(indices[0], indices[end]);
+        siftIndexDown<Key, Order>(items, indices, 0, end);
+    }
+    return indices;
+}
+
+template <class Key, class Order, class Items>
+void printSortedBy(const Items &items)
+{
+    for (int index : sortedIndicesBy<Key, Order>(items))
+        items[index].print();
+}
+
+template <class Items>
+void printSortedBy(const Items &items, bool sortByName, bool ascending)
+{
+    if (sortByName)
+        ascending ? printSortedBy<ByName, Ascending>(items) : printSortedBy<ByName, Descending>(items);
+    else
+        ascending ? printSortedBy<ByPrice, Ascending>(items) : printSortedBy<ByPrice, Descending>(items);
+}
+
+// Allocates arrays so that element LineStart begins a 64-byte cache line.
+// With LineStart = 0 this is plain cache-line alignment, which C++14's
+// std::allocator does not give alignas(64) types. Heaps use LineStart = 1:
+// the children of i are Arity*i+1 .. Arity*i+Arity, so every sibling group
+// then starts on a line boundary, and a group whose byte size is a multiple
+// of the line never straddles two lines.
+template <class T, int LineStart = 0>
+class LineAlignedAllocator
+{
+public:
+    typedef T value_type;
+
+    template <class U>
+    struct rebind
+    {
+        typedef LineAlignedAllocator<U, LineStart> other;
+    };
+
+    static const size_t LineSize = 64;
+
+    LineAlignedAllocator() {}
+
+    template <class U>
+    LineAlignedAllocator(const LineAlignedAllocator<U, LineStart> &) {}
+
+    T *allocate(size_t count)
+    {
+        size_t lead = LineStart * sizeof(T);
+        size_t header = sizeof(char *) + lead;
+        char *raw = static_cast<char *>(::operator new(count * sizeof(T) + header + LineSize));
+        uintptr_t line = (reinterpret_cast<uintptr_t>(raw) + header + LineSize - 1) / LineSize * LineSize;
+        char *first = reinterpret_cast<char *>(line) - lead;
+        memcpy(first - sizeof(char *), &raw, sizeof(char *));
+        return reinterpret_cast<T *>(first);
+    }
+
+    void deallocate(T *pointer, size_t)
+    {
+        char *raw;
+        memcpy(&raw, reinterpret_cast<char *>(pointer) - sizeof(char *), sizeof(char *));
+        ::operator delete(raw);
+    }
+};
+
+template <class T, class U, int LineStart>
+bool operator==(const LineAlignedAllocator<T, LineStart> &, const LineAlignedAllocator<U, LineStart> &)
+{
+    return true;
+}
+
+template <class T, class U, int LineStart>
+bool operator!=(const LineAlignedAllocator<T, LineStart> &, const LineAlignedAllocator<U, LineStart> &)
+{
+    return false;
+}
+
+struct NoMoveHook
+{
+    void operator()(int) const {}
+};
+
+// Hole-based sifts shared by the array heaps. before(a, b) is true when a
+// belongs above b, and moved(i) runs each time an element lands in slot i.
+template <int Arity>
+struct DaryHeapOps
+{
+    static_assert(Arity >= 2, "Heap arity must be at least 2");
+
+    static int parent(int i) {
+        return (i - 1) / Arity;
+    }
+    static int firstChild(int i) {
+        return (Arity * i + 1);
+    }
+
+    template <class T, class Before, class Moved>
+    static int siftUp(T *slots, int index, Before before, Moved moved) {
+        T moving = std::move(slots[index]);
+        while (index && before(moving, slots[parent(index)])) {
+            slots[index] = std::move(slots[parent(index)]);
+            moved(index);
+            index = parent(index);
+        }
+        slots[index] = std::move(moving);
+        moved(index);
+        return index;
+    }
+
+    template <class T, class Before, class Moved>
+    static int siftDown(T *slots, int index, int count, Before before, Moved moved) {
+        T moving = std::move(slots[index]);
+        int first;
+        while ((first = firstChild(index)) < count) {
+            int last = min(first + Arity, count);
+            int smallestOrLargest = first;
+
+            for (int child = first + 1; child < last; ++child)
+                if (before(slots[child], slots[smallestOrLargest]))
+                    smallestOrLargest = child;
+
+            if (!before(slots[smallestOrLargest], moving))
+                break;
+
+            slots[index] = std::move(slots[smallestOrLargest]);
+            moved(index);
+            index = smallestOrLargest;
+        }
+        slots[index] = std::move(moving);
+        moved(index);
+        return index;
+    }
+};
+
+template <class Key = ByName, class Order = Ascending, int Arity = 2>
 class Heap
 {
+private:
+    typedef DaryHeapOps<Arity> Ops;
+
+    vector<Item, LineAlignedAllocator<Item, 1>> heap;
+    int capacity;
+
+    static bool compare(const Item &item1, const Item &item2) {
+        return Order::before(Key::key(item1), Key::key(item2));
+    }
+
+    void heapifyUp(int index) {
+        Ops::siftUp(heap.data(), index, [](const Item &item1, const Item &item2)
+                    { return compare(item1, item2); },
+                    NoMoveHook());
+    }
+
+    void heapifyDown(int index) {
+        Ops::siftDown(heap.data(), index, size(), [](const Item &item1, const Item &item2)
+                      { return compare(item1, item2); },
+                      NoMoveHook());
+    }
+
+public:
+    static const bool isMinHeap = is_same<Order, Ascending>::value;
+
+    // A capacity of zero or less means the heap is unbounded. A full heap
+    // keeps the capacity items ordered last by Order, so use Order::Reverse
+    // to keep the k best.
+    explicit Heap(int capacity = 0) : capacity(max(0, capacity)) {}
+
+    bool isFull() const
+    {
+        return capacity && size() >= capacity;
+    }
+
+    void add(Item item)
+    {
+        if (!isFull())
+        {
+            heap.push_back(std::move(item));
+            heapifyUp(size() - 1);
+        }
+        else if (compare(heap[0], item))
+        {
+            heap[0] = std::move(item);
+            heapifyDown(0);
+        }
+    }
+
+    void remove()
+    {
+        if (size() > 1)
+        {
+            heap[0] = std::move(heap.back());
+            heap.pop_back();
+            heapifyDown(0);
+        }
+        else
+            heap.clear();
+    }
+
+    template <class InputIt>
+    void buildFrom(InputIt first, InputIt last)
+    {
+        for (; first != last && !isFull(); ++first)
+            heap.push_back(*first);
+
+        if (size() > 1)
+            for (int i = Ops::parent(size() - 1); i >= 0; --i)
+                heapifyDown(i);
+
+        for (; first != last; ++first)
+            add(*first);
+    }
+
+    void reserve(int capacity)
+    {
+        heap.reserve(capacity);
+    }
+
+    const Item &top() const
+    {
+        return heap.front();
+    }
+
+    void display() const
+    {
+        for (const auto &item : heap)
+        {
+            item.print();
+        }
+    }
+
+    int size() const
+    {
+        return heap.size();
+    }
+
+    void heapSortBy(bool sortByName = true, bool ascending = true) const
+    {
+        printSortedBy(heap, sortByName, ascending);
+    }
+
+    vector<Item> topK(int k, bool sortByName = true, bool ascending = true) const;
+};
+
+template <class Key, class Order, class InputIt>
+vector<Item> topK(InputIt first, InputIt last, int k)
+{
+    if (k <= 0)
+        return vector<Item>();
+
+    Heap<Key, typename Order::Reverse> kept(k);
+    for (; first != last; ++first)
+        kept.add(*first);
+
+    vector<Item> best;
+    best.reserve(kept.size());
+    while (kept.size())
+    {
+        best.push_back(kept.top());
+        kept.remove();
+    }
+    reverse(best.begin(), best.end());
+    return best;
+}
+
+template <class Key, class Order, int Arity>
+vector<Item> Heap<Key, Order, Arity>::topK(int k, bool sortByName, bool ascending) const
+{
+    k = min(k, size());
+    if (sortByName)
+        return ascending ? ::topK<ByName, Ascending>(heap.begin(), heap.end(), k)
+                         : ::topK<ByName, Descending>(heap.begin(), heap.end(), k);
+    return ascending ? ::topK<ByPrice, Ascending>(heap.begin(), heap.end(), k)
+                     : ::topK<ByPrice, Descending>(heap.begin(), heap.end(), k);
+}
+
+template <class Key = ByName, class Order = Ascending, int Arity = 2>
+class IndexedHeap
+{
+private:
+    typedef DaryHeapOps<Arity> Ops;
+
+    struct Entry
+    {
+        Item item;
+        int *position;
+    };
+
+    vector<Entry> heap;
+    unordered_map<string, int> positions;
+
+    static bool compare(const Entry &entry1, const Entry &entry2) {
+        return Order::before(Key::key(entry1.item), Key::key(entry2.item));
+    }
+
+    void place(int index, Entry &&entry) {
+        heap[index] = std::move(entry);
+        *heap[index].position = index;
+    }
+
+    bool heapifyUp(int index) {
+        return Ops::siftUp(heap.data(), index, [](const Entry &entry1, const Entry &entry2)
+                           { return compare(entry1, entry2); },
+                           [this](int slot)
+                           { *heap[slot].position = slot; }) != index;
+    }
+
+    void heapifyDown(int index) {
+        Ops::siftDown(heap.data(), index, size(), [](const Entry &entry1, const Entry &entry2)
+                      { return compare(entry1, entry2); },
+                      [this](int slot)
+                      { *heap[slot].position = slot; });
+    }
+
+    // Entries point into positions, so a copied heap rebuilds its own map.
+    void rebuildPositions() {
+        positions.clear();
+        positions.reserve(heap.size());
+        for (int i = 0; i < size(); ++i)
+            heap[i].position = &positions.emplace(heap[i].item.itemName, i).first->second;
+    }
+
+    void restore(int index) {
+        if (!heapifyUp(index))
+            heapifyDown(index);
+    }
+
+    void removeAt(int index) {
+        positions.erase(heap[index].item.itemName);
+        if (index != size() - 1) {
+            place(index, std::move(heap.back()));
+            heap.pop_back();
+            restore(index);
+        }
+        else
+            heap.pop_back();
+    }
+
+public:
+    IndexedHeap() {}
+
+    IndexedHeap(const IndexedHeap &other) : heap(other.heap)
+    {
+        rebuildPositions();
+    }
+
+    IndexedHeap(IndexedHeap &&) = default;
+
+    IndexedHeap &operator=(const IndexedHeap &other)
+    {
+        if (this != &other)
+        {
+            heap = other.heap;
+            rebuildPositions();
+        }
+        return *this;
+    }
+
+    IndexedHeap &operator=(IndexedHeap &&) = default;
+
+    void add(Item item)
+    {
+        auto found = positions.find(item.itemName);
+        if (found != positions.end())
+        {
+            heap[found->second].item = std::move(item);
+            restore(found->second);
+            return;
+        }
+
+        int *position = &positions.emplace(item.itemName, size()).first->second;
+        heap.push_back(Entry{std::move(item), position});
+        heapifyUp(size() - 1);
+    }
+
+    void remove()
+    {
+        if (size())
+            removeAt(0);
+    }
+
+    bool remove(const string &itemName)
+    {
+        auto found = positions.find(itemName);
+        if (found == positions.end())
+            return false;
+        removeAt(found->second);
+        return true;
+    }
+
+    bool updatePrice(const string &itemName, int newPrice)
+    {
+        auto found = positions.find(itemName);
+        if (found == positions.end())
+            return false;
+        heap[found->second].item.price = newPrice;
+        restore(found->second);
+        return true;
+    }
+
+    bool contains(const string &itemName) const
+    {
+        return positions.count(itemName) != 0;
+    }
+
+    const Item &top() const
+    {
+        return heap.front().item;
+    }
+
+    void display() const
+    {
+        for (const auto &entry : heap)
+        {
+            entry.item.print();
+        }
+    }
+
+    int size() const
+    {
+        return heap.size();
+    }
+};
+
+template <class Key = ByName>
+class MinMaxHeap
+{
 private:
     vector<Item> heap;
 
     int parent(int i) {
         return (i - 1) / 2;
     }
-    int left(int i) {
+    int firstChild(int i) {
         return (2 * i + 1);
     }
-    int right(int i) {
-        return (2 * i + 2);
+
+    static bool isMinLevel(int i) {
+        bool minLevel = true;
+        for (++i; i > 1; i /= 2)
+            minLevel = !minLevel;
+        return minLevel;
+    }
+
+    template <class Order>
+    static bool compare(const Item &item1, const Item &item2) {
+        return Order::before(Key::key(item1), Key::key(item2));
+    }
+
+    // Moves the hole at index up through grandparents while moving belongs
+    // above them and returns where the hole ends up.
+    template <class Order>
+    int pushUpLevel(int index, const Item &moving) {
+        while (index > 2 && compare<Order>(moving, heap[parent(parent(index))])) {
+            heap[index] = std::move(heap[parent(parent(index))]);
+            index = parent(parent(index));
+        }
+        return index;
+    }
+
+    void pushUp(int index) {
+        if (!index)
+            return;
+
+        Item moving = std::move(heap[index]);
+        int p = parent(index);
+        if (isMinLevel(index)) {
+            if (compare<Descending>(moving, heap[p])) {
+                heap[index] = std::move(heap[p]);
+                index = pushUpLevel<Descending>(p, moving);
+            }
+            else
+                index = pushUpLevel<Ascending>(index, moving);
+        }
+        else {
+            if (compare<Ascending>(moving, heap[p])) {
+                heap[index] = std::move(heap[p]);
+                index = pushUpLevel<Ascending>(p, moving);
+            }
+            else
+                index = pushUpLevel<Descending>(index, moving);
+        }
+        heap[index] = std::move(moving);
+    }
+
+    template <class Order>
+    void trickleDownLevel(int index) {
+        Item moving = std::move(heap[index]);
+        int first;
+        while ((first = firstChild(index)) < size()) {
+            int best = first;
+            if (first + 1 < size() && compare<Order>(heap[first + 1], heap[best]))
+                best = first + 1;
+
+            int firstGrandchild = firstChild(first);
+            int lastGrandchild = min(firstGrandchild + 4, size());
+            for (int grandchild = firstGrandchild; grandchild < lastGrandchild; ++grandchild)
+                if (compare<Order>(heap[grandchild], heap[best]))
+                    best = grandchild;
+
+            if (!compare<Order>(heap[best], moving))
+                break;
+
+            heap[index] = std::move(heap[best]);
+            index = best;
+            if (best < firstGrandchild)
+                break;
+
+            if (compare<typename Order::Reverse>(moving, heap[parent(best)]))
+                swap(moving, heap[parent(best)]);
+        }
+        heap[index] = std::move(moving);
+    }
+
+    void trickleDown(int index) {
+        if (isMinLevel(index))
+            trickleDownLevel<Ascending>(index);
+        else
+            trickleDownLevel<Descending>(index);
+    }
+
+    int maxIndex() const {
+        if (size() < 3)
+            return size() - 1;
+        return compare<Descending>(heap[2], heap[1]) ? 2 : 1;
+    }
+
+    void removeAt(int index) {
+        if (index != size() - 1) {
+            heap[index] = std::move(heap.back());
+            heap.pop_back();
+            trickleDown(index);
+        }
+        else
+            heap.pop_back();
+    }
+
+public:
+    void add(Item item)
+    {
+        heap.push_back(std::move(item));
+        pushUp(size() - 1);
     }
 
-    bool compare(const Item &item1, const Item &item2, bool sortByName, bool ascending) {
-        if (sortByName) {
-            return ascending ? item1.itemName < item2.itemName : item1.itemName > item2.itemName;
-        } else {
-            return ascending ? item1.price < item2.price : item1.price > item2.price;
+    template <class InputIt>
+    void buildFrom(InputIt first, InputIt last)
+    {
+        heap.insert(heap.end(), first, last);
+        if (size() > 1)
+            for (int i = parent(size() - 1); i >= 0; --i)
+                trickleDown(i);
+    }
+
+    void reserve(int capacity)
+    {
+        heap.reserve(capacity);
+    }
+
+    const Item &peekMin() const
+    {
+        return heap.front();
+    }
+
+    const Item &peekMax() const
+    {
+        return heap[maxIndex()];
+    }
+
+    void popMin()
+    {
+        if (size())
+            removeAt(0);
+    }
+
+    void popMax()
+    {
+        if (size())
+            removeAt(maxIndex());
+    }
+
+    void display() const
+    {
+        for (const auto &item : heap)
+        {
+            item.print();
+        }
+    }
+
+    int size() const
+    {
+        return heap.size();
+    }
+
+    void heapSortBy(bool sortByName = true, bool ascending = true) const
+    {
+        printSortedBy(heap, sortByName, ascending);
+    }
+};
+
+// Items keyed at or after the last extracted price go into radix buckets.
+// Items that arrive out of order sort before everything bucketed, so they
+// wait in a small overflow heap that is drained first.
+template <class Order = Ascending>
+class RadixHeap
+{
+private:
+    mutable vector<Item> buckets[33];
+    mutable unsigned last;
+    int bucketed;
+    Heap<ByPrice, Order> overflow;
+
+    static unsigned key(const Item &item) {
+        unsigned ordered = static_cast<unsigned>(item.price) ^ 0x80000000u;
+        return is_same<Order, Ascending>::value ? ordered : ~ordered;
+    }
+
+    static int bucketFor(unsigned itemKey, unsigned lastKey) {
+        unsigned diff = itemKey ^ lastKey;
+#ifdef __GNUC__
+        return diff ? 32 - __builtin_clz(diff) : 0;
+#else
+        int bucket = 0;
+        for (; diff; diff >>= 1)
+            ++bucket;
+        return bucket;
+#endif
+    }
+
+    void refill() const {
+        if (!buckets[0].empty() || !bucketed)
+            return;
+
+        int i = 1;
+        while (buckets[i].empty())
+            ++i;
+
+        last = key(buckets[i][0]);
+        for (const auto &item : buckets[i])
+            last = min(last, key(item));
+
+        for (auto &item : buckets[i])
+            buckets[bucketFor(key(item), last)].push_back(std::move(item));
+        buckets[i].clear();
+    }
+
+public:
+    RadixHeap() : last(0), bucketed(0) {}
+
+    void add(Item item)
+    {
+        unsigned itemKey = key(item);
+        if (itemKey < last)
+        {
+            overflow.add(std::move(item));
+            return;
+        }
+
+        buckets[bucketFor(itemKey, last)].push_back(std::move(item));
+        ++bucketed;
+    }
+
+    template <class InputIt>
+    void buildFrom(InputIt first, InputIt end)
+    {
+        for (; first != end; ++first)
+            add(*first);
+    }
+
+    // Buckets grow independently, so there is no single array to presize.
+    void reserve(int) {}
+
+    void remove()
+    {
+        if (overflow.size())
+        {
+            overflow.remove();
+            return;
+        }
+        refill();
+        if (bucketed)
+        {
+            buckets[0].pop_back();
+            --bucketed;
+        }
+    }
+
+    const Item &top() const
+    {
+        if (overflow.size())
+            return overflow.top();
+        refill();
+        return buckets[0].back();
+    }
+
+    void display() const
+    {
+        overflow.display();
+        for (const auto &bucket : buckets)
+        {
+            for (const auto &item : bucket)
+            {
+                item.print();
+            }
+        }
+    }
+
+    int size() const
+    {
+        return bucketed + overflow.size();
+    }
+};
+
+template <class Key, class Order>
+struct MonotoneQueue
+{
+    typedef Heap<Key, Order> type;
+};
+
+template <class Order>
+struct MonotoneQueue<ByPrice, Order>
+{
+    typedef RadixHeap<Order> type;
+};
+
+template <class Key, bool Inline = is_arithmetic<typename decay<decltype(Key::key(declval<const Item &>()))>::type>::value>
+struct ItemHandle
+{
+    typename decay<decltype(Key::key(declval<const Item &>()))>::type key;
+    uint32_t index;
+
+    ItemHandle(const vector<Item> &items, uint32_t index) : key(Key::key(items[index])), index(index) {}
+
+    decltype(key) sortKey(const vector<Item> &) const { return key; }
+};
+
+template <class Key>
+struct ItemHandle<Key, false>
+{
+    uint32_t index;
+
+    ItemHandle(const vector<Item> &, uint32_t index) : index(index) {}
+
+    decltype(auto) sortKey(const vector<Item> &items) const { return Key::key(items[index]); }
+};
+
+template <class Key = ByPrice, class Order = Ascending, int Arity = 2>
+class HandleHeap
+{
+private:
+    typedef DaryHeapOps<Arity> Ops;
+
+    vector<Item> *items;
+    vector<ItemHandle<Key>, LineAlignedAllocator<ItemHandle<Key>, 1>> heap;
+
+    bool compare(const ItemHandle<Key> &handle1, const ItemHandle<Key> &handle2) const {
+        return Order::before(handle1.sortKey(*items), handle2.sortKey(*items));
+    }
+
+    void heapifyUp(int index) {
+        Ops::siftUp(heap.data(), index, [this](const ItemHandle<Key> &handle1, const ItemHandle<Key> &handle2)
+                    { return compare(handle1, handle2); },
+                    NoMoveHook());
+    }
+
+    void heapifyDown(int index) {
+        Ops::siftDown(heap.data(), index, size(), [this](const ItemHandle<Key> &handle1, const ItemHandle<Key> &handle2)
+                      { return compare(handle1, handle2); },
+                      NoMoveHook());
+    }
+
+public:
+    explicit HandleHeap(vector<Item> &items) : items(&items) {}
+
+    void add(uint32_t index)
+    {
+        heap.push_back(ItemHandle<Key>(*items, index));
+        heapifyUp(size() - 1);
+    }
+
+    void add(Item item)
+    {
+        items->push_back(std::move(item));
+        add(static_cast<uint32_t>(items->size() - 1));
+    }
+
+    void remove()
+    {
+        if (size())
+        {
+            heap[0] = heap.back();
+            heap.pop_back();
+            if (size())
+                heapifyDown(0);
+        }
+    }
+
+    uint32_t topIndex() const
+    {
+        return heap.front().index;
+    }
+
+    const Item &top() const
+    {
+        return (*items)[topIndex()];
+    }
+
+    void display() const
+    {
+        for (const auto &handle : heap)
+        {
+            (*items)[handle.index].print();
+        }
+    }
+
+    int size() const
+    {
+        return heap.size();
+    }
+};
+
+class PairingNode
+{
+public:
+    Item data;
+    PairingNode *child;
+    PairingNode *sibling;
+
+    PairingNode(Item item) : data(std::move(item)), child(nullptr), sibling(nullptr) {}
+};
+
+template <class Key = ByName, class Order = Ascending>
+class PairingHeap
+{
+private:
+    PairingNode *root;
+    int count;
+
+    static bool compare(const Item &item1, const Item &item2) {
+        return Order::before(Key::key(item1), Key::key(item2));
+    }
+
+    static PairingNode *meld(PairingNode *first, PairingNode *second) {
+        if (!first)
+            return second;
+        if (!second)
+            return first;
+        if (compare(second->data, first->data))
+            swap(first, second);
+        second->sibling = first->child;
+        first->child = second;
+        return first;
+    }
+
+    static PairingNode *mergePairs(PairingNode *first) {
+        PairingNode *paired = nullptr;
+        while (first) {
+            PairingNode *second = first->sibling;
+            if (!second) {
+                first->sibling = paired;
+                paired = first;
+                break;
+            }
+            PairingNode *next = second->sibling;
+            first->sibling = second->sibling = nullptr;
+            PairingNode *pair = meld(first, second);
+            pair->sibling = paired;
+            paired = pair;
+            first = next;
+        }
+
+        PairingNode *result = nullptr;
+        while (paired) {
+            PairingNode *next = paired->sibling;
+            paired->sibling = nullptr;
+            result = meld(result, paired);
+            paired = next;
+        }
+        return result;
+    }
+
+    void clear() {
+        PairingNode *pending = root;
+        while (pending) {
+            PairingNode *node = pending;
+            if (node->child) {
+                PairingNode *last = node->child;
+                while (last->sibling)
+                    last = last->sibling;
+                last->sibling = node->sibling;
+                pending = node->child;
+            }
+            else
+                pending = node->sibling;
+            delete node;
+        }
+        root = nullptr;
+        count = 0;
+    }
+
+public:
+    PairingHeap() : root(nullptr), count(0) {}
+
+    PairingHeap(const PairingHeap &) = delete;
+    PairingHeap &operator=(const PairingHeap &) = delete;
+
+    PairingHeap(PairingHeap &&other) : root(other.root), count(other.count)
+    {
+        other.root = nullptr;
+        other.count = 0;
+    }
+
+    ~PairingHeap()
+    {
+        clear();
+    }
+
+    void add(Item item)
+    {
+        root = meld(root, new PairingNode(std::move(item)));
+        ++count;
+    }
+
+    void merge(PairingHeap &&other)
+    {
+        if (this == &other)
+            return;
+        root = meld(root, other.root);
+        count += other.count;
+        other.root = nullptr;
+        other.count = 0;
+    }
+
+    void remove()
+    {
+        if (root)
+        {
+            PairingNode *oldRoot = root;
+            root = mergePairs(root->child);
+            delete oldRoot;
+            --count;
+        }
+    }
+
+    const Item &top() const
+    {
+        return root->data;
+    }
+
+    void display() const
+    {
+        vector<const PairingNode *> pending;
+        if (root)
+            pending.push_back(root);
+        while (!pending.empty())
+        {
+            const PairingNode *node = pending.back();
+            pending.pop_back();
+            node->data.print();
+            if (node->sibling)
+                pending.push_back(node->sibling);
+            if (node->child)
+                pending.push_back(node->child);
+        }
+    }
+
+    int size() const
+    {
+        return count;
+    }
+};
+
+template <class Key = ByName, class Order = Ascending>
+class MultiQueue
+{
+private:
+    // Each shard owns its own cache lines. size mirrors heap.size(): it is
+    // written under the lock and read without it to skip empty shards.
+    struct alignas(64) Shard
+    {
+        mutex lock;
+        atomic<int> size;
+        Heap<Key, Order> heap;
+
+        Shard() : size(0) {}
+    };
+
+    vector<Shard, LineAlignedAllocator<Shard>> shards;
+
+    static bool compare(const Item &item1, const Item &item2) {
+        return Order::before(Key::key(item1), Key::key(item2));
+    }
+
+    static unsigned randomIndex(unsigned bound) {
+        static thread_local unsigned state = 2463534242u ^ static_cast<unsigned>(hash<thread::id>()(this_thread::get_id()));
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % bound;
+    }
+
+    static void popTop(Shard &shard, Item &item) {
+        item = shard.heap.top();
+        shard.heap.remove();
+        shard.size.store(shard.heap.size(), memory_order_relaxed);
+    }
+
+    static bool popFrom(Shard &shard, Item &item) {
+        if (!shard.size.load(memory_order_relaxed))
+            return false;
+        lock_guard<mutex> guard(shard.lock);
+        if (!shard.heap.size())
+            return false;
+        popTop(shard, item);
+        return true;
+    }
+
+public:
+    explicit MultiQueue(int threads, int queuesPerThread = 2)
+        : shards(max(1, threads * queuesPerThread)) {}
+
+    void add(Item item)
+    {
+        for (;;)
+        {
+            Shard &shard = shards[randomIndex(shards.size())];
+            unique_lock<mutex> guard(shard.lock, try_to_lock);
+            if (guard.owns_lock())
+            {
+                shard.heap.add(std::move(item));
+                shard.size.store(shard.heap.size(), memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    bool tryRemove(Item &item)
+    {
+        while (shards.size() > 1)
+        {
+            Shard &first = shards[randomIndex(shards.size())];
+            Shard &second = shards[randomIndex(shards.size())];
+            if (&first == &second)
+                continue;
+            if (!first.size.load(memory_order_relaxed) && !second.size.load(memory_order_relaxed))
+                break;
+
+            unique_lock<mutex> firstGuard(first.lock, try_to_lock);
+            if (!firstGuard.owns_lock())
+                continue;
+            unique_lock<mutex> secondGuard(second.lock, try_to_lock);
+            if (!secondGuard.owns_lock())
+                continue;
+
+            Shard *best = nullptr;
+            if (first.heap.size())
+                best = &first;
+            if (second.heap.size() && (!best || compare(second.heap.top(), best->heap.top())))
+                best = &second;
+            if (!best)
+                break;
+
+            popTop(*best, item);
+            return true;
+        }
+
+        for (auto &shard : shards)
+            if (popFrom(shard, item))
+                return true;
+        return false;
+    }
+
+    // Sums the per-shard sizes, so it is only a snapshot while other threads
+    // are adding or removing.
+    int size() const
+    {
+        int total = 0;
+        for (const auto &shard : shards)
+            total += shard.size.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+template <class Node>
+class NodePool
+{
+private:
+    union Slot
+    {
+        Slot *next;
+        typename aligned_storage<sizeof(Node), alignof(Node)>::type storage;
+    };
+
+    static const int SlabSize = 1024;
+
+    vector<unique_ptr<Slot[]>> slabs;
+    Slot *freeList;
+    int used;
+
+public:
+    NodePool() : freeList(nullptr), used(SlabSize) {}
+
+    NodePool(const NodePool &) = delete;
+    NodePool &operator=(const NodePool &) = delete;
+
+    template <class... Args>
+    Node *create(Args &&...args)
+    {
+        Slot *slot = freeList;
+        if (slot)
+            freeList = slot->next;
+        else
+        {
+            if (used == SlabSize)
+            {
+                slabs.emplace_back(new Slot[SlabSize]);
+                used = 0;
+            }
+            slot = &slabs.back()[used++];
+        }
+        return new (&slot->storage) Node(std::forward<Args>(args)...);
+    }
+
+    void destroy(Node *node)
+    {
+        node->~Node();
+        Slot *slot = reinterpret_cast<Slot *>(node);
+        slot->next = freeList;
+        freeList = slot;
+    }
+};
+
+struct PriceIndexOrder
+{
+    typedef void is_transparent;
+
+    bool operator()(const Item *item1, const Item *item2) const
+    {
+        if (item1->price != item2->price)
+            return item1->price < item2->price;
+        int byName = item1->itemName.compare(item2->itemName);
+        if (byName)
+            return byName < 0;
+        return less<const Item *>()(item1, item2);
+    }
+
+    bool operator()(const Item *item, int price) const
+    {
+        return item->price < price;
+    }
+
+    bool operator()(int price, const Item *item) const
+    {
+        return price < item->price;
+    }
+};
+
+typedef set<const Item *, PriceIndexOrder> PriceIndex;
+
+void printPriceIndex(const PriceIndex &index, bool ascending)
+{
+    if (ascending)
+        for (auto it = index.begin(); it != index.end(); ++it)
+            (*it)->print();
+    else
+        for (auto it = index.rbegin(); it != index.rend(); ++it)
+            (*it)->print();
+}
+
+void printPriceRange(const PriceIndex &index, int loPrice, int hiPrice)
+{
+    if (hiPrice < loPrice)
+        return;
+    for (auto it = index.lower_bound(loPrice), end = index.upper_bound(hiPrice); it != end; ++it)
+        (*it)->print();
+}
+
+template <class Node>
+Node *leftmost(Node *node)
+{
+    if (node)
+        while (node->left)
+            node = node->left;
+    return node;
+}
+
+template <class Node>
+Node *nextInOrder(Node *node)
+{
+    if (node->right)
+        return leftmost(node->right);
+
+    Node *child = node;
+    node = node->parent;
+    while (node && child == node->right)
+    {
+        child = node;
+        node = node->parent;
+    }
+    return node;
+}
+
+template <class Node>
+Node *lowerBoundNode(Node *node, const string &itemName, bool inclusive)
+{
+    Node *candidate = nullptr;
+    while (node)
+    {
+        if (node->data.itemName > itemName || (inclusive && node->data.itemName == itemName))
+        {
+            candidate = node;
+            node = node->left;
+        }
+        else
+            node = node->right;
+    }
+    return candidate;
+}
+
+template <class Node>
+Node *prevInOrder(Node *node)
+{
+    if (node->left)
+    {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return node;
+    }
+
+    Node *child = node;
+    node = node->parent;
+    while (node && child == node->left)
+    {
+        child = node;
+        node = node->parent;
+    }
+    return node;
+}
+
+// Remembers the last inserted node and its in-order neighbours so that
+// sorted or clustered inserts avoid a full descent from the root.
+template <class Node>
+class Finger
+{
+private:
+    Node *node;
+    Node *prev;
+    Node *next;
+
+public:
+    Finger() : node(nullptr), prev(nullptr), next(nullptr) {}
+
+    void reset()
+    {
+        node = prev = next = nullptr;
+    }
+
+    void moveTo(Node *inserted, Node *before, Node *after)
+    {
+        node = inserted;
+        prev = before;
+        next = after;
+    }
+
+    void moveTo(Node *inserted)
+    {
+        moveTo(inserted, prevInOrder(inserted), nextInOrder(inserted));
+    }
+
+    // If item sorts right next to the finger (before <= item < after), returns
+    // the empty child slot between those two neighbours; otherwise nullptr.
+    Node **adjacentSlot(const Item &item, Node *&parent, Node *&before, Node *&after) const
+    {
+        if (!node)
+            return nullptr;
+
+        if (item < node->data)
+        {
+            before = prev;
+            after = node;
+        }
+        else
+        {
+            before = node;
+            after = next;
+        }
+        if ((before && item < before->data) || (after && !(item < after->data)))
+            return nullptr;
+
+        if (before && !before->right)
+        {
+            parent = before;
+            return &before->right;
+        }
+        parent = after;
+        return &after->left;
+    }
+
+    // Climbs to the lowest ancestor of the finger whose subtree must hold the
+    // insertion point for item; a descent from there lands where one from
+    // the root would.
+    Node *start(Node *root, const Item &item) const
+    {
+        if (!node)
+            return root;
+
+        Node *top = node;
+        if (item < node->data)
+            while (top->parent && (top == top->parent->left || !(top->parent->data < item)))
+                top = top->parent;
+        else
+            while (top->parent && (top == top->parent->right || !(item < top->parent->data)))
+                top = top->parent;
+        return top;
+    }
+};
+
+template <class Node>
+class TreeIterator
+{
+private:
+    const Node *node;
+    const Node *const *root;
+
+public:
+    typedef bidirectional_iterator_tag iterator_category;
+    typedef Item value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const Item *pointer;
+    typedef const Item &reference;
+
+    TreeIterator(const Node *node, const Node *const *root) : node(node), root(root) {}
+
+    reference operator*() const
+    {
+        return node->data;
+    }
+
+    pointer operator->() const
+    {
+        return &node->data;
+    }
+
+    TreeIterator &operator++()
+    {
+        node = nextInOrder(node);
+        return *this;
+    }
+
+    TreeIterator &operator--()
+    {
+        if (!node)
+        {
+            node = *root;
+            while (node->right)
+                node = node->right;
+        }
+        else if (node->left)
+        {
+            node = node->left;
+            while (node->right)
+                node = node->right;
+        }
+        else
+        {
+            const Node *child = node;
+            node = node->parent;
+            while (node && child == node->left)
+            {
+                child = node;
+                node = node->parent;
+            }
+        }
+        return *this;
+    }
+
+    TreeIterator operator++(int)
+    {
+        TreeIterator old = *this;
+        ++*this;
+        return old;
+    }
+
+    TreeIterator operator--(int)
+    {
+        TreeIterator old = *this;
+        --*this;
+        return old;
+    }
+
+    bool operator==(const TreeIterator &other) const
+    {
+        return node == other.node;
+    }
+
+    bool operator!=(const TreeIterator &other) const
+    {
+        return node != other.node;
+    }
+};
+
+struct PriceAggregate
+{
+    int count;
+    long long sum;
+    int minPrice;
+    int maxPrice;
+
+    PriceAggregate() : count(0), sum(0), minPrice(0), maxPrice(0) {}
+
+    void add(int otherCount, long long otherSum, int otherMin, int otherMax)
+    {
+        if (!otherCount)
+            return;
+        minPrice = count ? min(minPrice, otherMin) : otherMin;
+        maxPrice = count ? max(maxPrice, otherMax) : otherMax;
+        count += otherCount;
+        sum += otherSum;
+    }
+
+    void add(const Item &item)
+    {
+        add(1, item.price, item.price, item.price);
+    }
+};
+
+class AVLNode
+{
+public:
+    Item data;
+    AVLNode *left;
+    AVLNode *right;
+    AVLNode *parent;
+    int height;
+    int size;
+    long long priceSum;
+    int minPrice;
+    int maxPrice;
+
+    AVLNode(const Item &item, AVLNode *parent = nullptr)
+        : data(item), left(nullptr), right(nullptr), parent(parent), height(1), size(1),
+          priceSum(data.price), minPrice(data.price), maxPrice(data.price) {}
+    AVLNode(Item &&item, AVLNode *parent = nullptr)
+        : data(std::move(item)), left(nullptr), right(nullptr), parent(parent), height(1), size(1),
+          priceSum(data.price), minPrice(data.price), maxPrice(data.price) {}
+};
+
+class AVL
+{
+private:
+    AVLNode *root;
+    Finger<AVLNode> finger;
+    NodePool<AVLNode> pool;
+    PriceIndex priceIndex;
+
+    int height(AVLNode *node)
+    {
+        return node ? node->height : 0;
+    }
+
+    static int size(const AVLNode *node)
+    {
+        return node ? node->size : 0;
+    }
+
+    int getBalance(AVLNode *node)
+    {
+        return node ? height(node->left) - height(node->right) : 0;
+    }
+
+    static void pullPrices(AVLNode *node, const AVLNode *child)
+    {
+        if (!child)
+            return;
+        node->priceSum += child->priceSum;
+        node->minPrice = min(node->minPrice, child->minPrice);
+        node->maxPrice = max(node->maxPrice, child->maxPrice);
+    }
+
+    void update(AVLNode *node)
+    {
+        node->height = max(height(node->left), height(node->right)) + 1;
+        node->size = size(node->left) + size(node->right) + 1;
+        node->priceSum = node->minPrice = node->maxPrice = node->data.price;
+        pullPrices(node, node->left);
+        pullPrices(node, node->right);
+    }
+
+    AVLNode *rightRotate(AVLNode *y)
+    {
+        AVLNode *x = y->left;
+        AVLNode *T2 = x->right;
+        x->right = y;
+        y->left = T2;
+        if (T2)
+            T2->parent = y;
+        x->parent = y->parent;
+        y->parent = x;
+        update(y);
+        update(x);
+        return x;
+    }
+
+    AVLNode *leftRotate(AVLNode *x)
+    {
+        AVLNode *y = x->right;
+        AVLNode *T2 = y->left;
+        y->left = x;
+        x->right = T2;
+        if (T2)
+            T2->parent = x;
+        y->parent = x->parent;
+        x->parent = y;
+        update(x);
+        update(y);
+        return y;
+    }
+
+    AVLNode *rebalance(AVLNode *node)
+    {
+        update(node);
+
+        int balance = getBalance(node);
+
+        if (balance > 1)
+        {
+            if (getBalance(node->left) < 0)
+                node->left = leftRotate(node->left);
+            return rightRotate(node);
+        }
+
+        if (balance < -1)
+        {
+            if (getBalance(node->right) > 0)
+                node->right = rightRotate(node->right);
+            return leftRotate(node);
+        }
+
+        return node;
+    }
+
+    template <class ItemRef>
+    void insert(ItemRef &&item)
+    {
+        AVLNode *parent = nullptr, *before = nullptr, *after = nullptr;
+        AVLNode **link = finger.adjacentSlot(item, parent, before, after);
+        bool adjacent = link != nullptr;
+        if (adjacent)
+        {
+            if (before && !(before->data < item))
+                return;
+        }
+        else
+        {
+            AVLNode *start = finger.start(root, item);
+            parent = start ? start->parent : nullptr;
+            link = &linkOf(parent, start);
+            while (*link)
+            {
+                parent = *link;
+                if (item < parent->data)
+                    link = &parent->left;
+                else if (item > parent->data)
+                    link = &parent->right;
+                else
+                    return;
+            }
+        }
+
+        AVLNode *node = *link = pool.create(std::forward<ItemRef>(item), parent);
+        priceIndex.insert(&node->data);
+        if (adjacent)
+            finger.moveTo(node, before, after);
+        else
+            finger.moveTo(node);
+        retraceFrom(parent);
+    }
+
+    AVLNode *&linkOf(AVLNode *parent, AVLNode *child)
+    {
+        if (!parent)
+            return root;
+        return parent->left == child ? parent->left : parent->right;
+    }
+
+    void replaceNode(AVLNode *node, AVLNode *replacement)
+    {
+        linkOf(node->parent, node) = replacement;
+        if (replacement)
+            replacement->parent = node->parent;
+    }
+
+    void retraceFrom(AVLNode *node)
+    {
+        bool heightChanged = true;
+        while (node)
+        {
+            AVLNode *parent = node->parent;
+            if (heightChanged)
+            {
+                int oldHeight = node->height;
+                AVLNode *balanced = rebalance(node);
+                if (balanced != node)
+                    linkOf(parent, node) = balanced;
+                heightChanged = balanced->height != oldHeight;
+            }
+            else
+                update(node);
+            node = parent;
+        }
+    }
+
+    void erase(AVLNode *node)
+    {
+        priceIndex.erase(&node->data);
+
+        AVLNode *retraceStart = node->parent;
+        if (!node->left || !node->right)
+            replaceNode(node, node->left ? node->left : node->right);
+        else
+        {
+            AVLNode *successor = leftmost(node->right);
+            if (successor->parent == node)
+                retraceStart = successor;
+            else
+            {
+                retraceStart = successor->parent;
+                retraceStart->left = successor->right;
+                if (successor->right)
+                    successor->right->parent = retraceStart;
+                successor->right = node->right;
+                successor->right->parent = successor;
+            }
+            successor->left = node->left;
+            successor->left->parent = successor;
+            successor->height = node->height;
+            replaceNode(node, successor);
+        }
+
+        pool.destroy(node);
+        retraceFrom(retraceStart);
+    }
+
+    AVLNode *buildBalanced(vector<AVLNode *> &nodes, int lo, int hi, AVLNode *parent)
+    {
+        if (lo >= hi)
+            return nullptr;
+
+        int mid = lo + (hi - lo) / 2;
+        AVLNode *node = nodes[mid];
+        node->parent = parent;
+        node->left = buildBalanced(nodes, lo, mid, node);
+        node->right = buildBalanced(nodes, mid + 1, hi, node);
+        update(node);
+        return node;
+    }
+
+    struct SetEffects
+    {
+        vector<AVLNode *> added;
+        vector<AVLNode *> removed;
+
+        void absorb(SetEffects &other)
+        {
+            added.insert(added.end(), other.added.begin(), other.added.end());
+            removed.insert(removed.end(), other.removed.begin(), other.removed.end());
+        }
+    };
+
+    static const int ParallelGrain = 1024;
+
+    AVLNode *detach(AVLNode *node)
+    {
+        if (node)
+            node->parent = nullptr;
+        return node;
+    }
+
+    AVLNode *joinRight(AVLNode *left, AVLNode *mid, AVLNode *right)
+    {
+        if (height(left->right) <= height(right) + 1)
+        {
+            mid->left = left->right;
+            mid->right = right;
+            if (mid->left)
+                mid->left->parent = mid;
+            if (right)
+                right->parent = mid;
+            update(mid);
+            left->right = mid;
+        }
+        else
+            left->right = joinRight(left->right, mid, right);
+        left->right->parent = left;
+        return rebalance(left);
+    }
+
+    AVLNode *joinLeft(AVLNode *left, AVLNode *mid, AVLNode *right)
+    {
+        if (height(right->left) <= height(left) + 1)
+        {
+            mid->left = left;
+            mid->right = right->left;
+            if (left)
+                left->parent = mid;
+            if (mid->right)
+                mid->right->parent = mid;
+            update(mid);
+            right->left = mid;
+        }
+        else
+            right->left = joinLeft(left, mid, right->left);
+        right->left->parent = right;
+        return rebalance(right);
+    }
+
+    AVLNode *join(AVLNode *left, AVLNode *mid, AVLNode *right)
+    {
+        AVLNode *joined;
+        if (height(left) > height(right) + 1)
+            joined = joinRight(left, mid, right);
+        else if (height(right) > height(left) + 1)
+            joined = joinLeft(left, mid, right);
+        else
+        {
+            mid->left = left;
+            mid->right = right;
+            if (left)
+                left->parent = mid;
+            if (right)
+                right->parent = mid;
+            update(mid);
+            joined = mid;
+        }
+        return detach(joined);
+    }
+
+    AVLNode *splitLast(AVLNode *node, AVLNode *&rest)
+    {
+        AVLNode *left = detach(node->left);
+        if (!node->right)
+        {
+            rest = left;
+            node->left = nullptr;
+            update(node);
+            return node;
+        }
+        AVLNode *rightRest;
+        AVLNode *last = splitLast(detach(node->right), rightRest);
+        rest = join(left, node, rightRest);
+        return last;
+    }
+
+    AVLNode *join2(AVLNode *left, AVLNode *right)
+    {
+        if (!left)
+            return right;
+        AVLNode *rest;
+        AVLNode *last = splitLast(left, rest);
+        return join(rest, last, right);
+    }
+
+    void split(AVLNode *node, const string &itemName, AVLNode *&less, AVLNode *&found, AVLNode *&greater)
+    {
+        if (!node)
+        {
+            less = found = greater = nullptr;
+            return;
+        }
+
+        AVLNode *left = detach(node->left);
+        AVLNode *right = detach(node->right);
+        node->left = node->right = nullptr;
+        update(node);
+
+        if (itemName < node->data.itemName)
+        {
+            AVLNode *leftGreater;
+            split(left, itemName, less, found, leftGreater);
+            greater = join(leftGreater, node, right);
+        }
+        else if (itemName > node->data.itemName)
+        {
+            AVLNode *rightLess;
+            split(right, itemName, rightLess, found, greater);
+            less = join(left, node, rightLess);
+        }
+        else
+        {
+            less = left;
+            found = node;
+            greater = right;
+        }
+    }
+
+    AVLNode *copyTree(const AVLNode *node, AVLNode *parent)
+    {
+        if (!node)
+            return nullptr;
+        AVLNode *copy = pool.create(node->data, parent);
+        copy->left = copyTree(node->left, copy);
+        copy->right = copyTree(node->right, copy);
+        update(copy);
+        return copy;
+    }
+
+    static void collectNodes(AVLNode *node, vector<AVLNode *> &nodes)
+    {
+        for (node = leftmost(node); node; node = nextInOrder(node))
+            nodes.push_back(node);
+    }
+
+    AVLNode *unionNodes(AVLNode *mine, AVLNode *theirs, int depth, SetEffects &effects)
+    {
+        if (!theirs)
+            return mine;
+        if (!mine)
+        {
+            collectNodes(theirs, effects.added);
+            return theirs;
+        }
+
+        AVLNode *less, *found, *greater;
+        split(mine, theirs->data.itemName, less, found, greater);
+        AVLNode *theirLeft = detach(theirs->left);
+        AVLNode *theirRight = detach(theirs->right);
+        theirs->left = theirs->right = nullptr;
+
+        AVLNode *mid = theirs;
+        if (found)
+        {
+            effects.removed.push_back(theirs);
+            mid = found;
+        }
+        else
+            effects.added.push_back(theirs);
+
+        AVLNode *left, *right;
+        runBoth(depth, size(theirLeft) + size(theirRight), effects, left, right,
+                [&](SetEffects &e) { return unionNodes(less, theirLeft, depth - 1, e); },
+                [&](SetEffects &e) { return unionNodes(greater, theirRight, depth - 1, e); });
+        return join(left, mid, right);
+    }
+
+    AVLNode *intersectNodes(AVLNode *mine, const AVLNode *theirs, int depth, SetEffects &effects)
+    {
+        if (!mine)
+            return nullptr;
+        if (!theirs)
+        {
+            collectNodes(mine, effects.removed);
+            return nullptr;
+        }
+
+        AVLNode *less, *found, *greater;
+        split(mine, theirs->data.itemName, less, found, greater);
+
+        AVLNode *left, *right;
+        runBoth(depth, size(theirs), effects, left, right,
+                [&](SetEffects &e) { return intersectNodes(less, theirs->left, depth - 1, e); },
+                [&](SetEffects &e) { return intersectNodes(greater, theirs->right, depth - 1, e); });
+        return found ? join(left, found, right) : join2(left, right);
+    }
+
+    AVLNode *differenceNodes(AVLNode *mine, const AVLNode *theirs, int depth, SetEffects &effects)
+    {
+        if (!mine || !theirs)
+            return mine;
+
+        AVLNode *less, *found, *greater;
+        split(mine, theirs->data.itemName, less, found, greater);
+        if (found)
+            effects.removed.push_back(found);
+
+        AVLNode *left, *right;
+        runBoth(depth, size(theirs), effects, left, right,
+                [&](SetEffects &e) { return differenceNodes(less, theirs->left, depth - 1, e); },
+                [&](SetEffects &e) { return differenceNodes(greater, theirs->right, depth - 1, e); });
+        return join2(left, right);
+    }
+
+    template <class LeftTask, class RightTask>
+    static void runBoth(int depth, int work, SetEffects &effects, AVLNode *&left, AVLNode *&right,
+                        LeftTask leftTask, RightTask rightTask)
+    {
+        if (depth > 0 && work >= ParallelGrain)
+        {
+            SetEffects leftEffects;
+            auto pending = async(launch::async, [&]
+                                 { return leftTask(leftEffects); });
+            right = rightTask(effects);
+            left = pending.get();
+            effects.absorb(leftEffects);
+        }
+        else
+        {
+            left = leftTask(effects);
+            right = rightTask(effects);
+        }
+    }
+
+    void applyEffects(AVLNode *newRoot, SetEffects &effects)
+    {
+        root = detach(newRoot);
+        finger.reset();
+        for (AVLNode *node : effects.added)
+            priceIndex.insert(&node->data);
+        for (AVLNode *node : effects.removed)
+        {
+            priceIndex.erase(&node->data);
+            pool.destroy(node);
+        }
+    }
+
+    static int parallelDepth(int threads)
+    {
+        int depth = 0;
+        for (int workers = 1; workers < threads; workers *= 2)
+            ++depth;
+        return depth;
+    }
+
+    static void absorb(PriceAggregate &result, const AVLNode *node)
+    {
+        if (node)
+            result.add(node->size, node->priceSum, node->minPrice, node->maxPrice);
+    }
+
+    static void absorbFrom(PriceAggregate &result, const AVLNode *node, const string &loName)
+    {
+        while (node)
+        {
+            if (node->data.itemName < loName)
+                node = node->right;
+            else
+            {
+                result.add(node->data);
+                absorb(result, node->right);
+                node = node->left;
+            }
+        }
+    }
+
+    static void absorbUpTo(PriceAggregate &result, const AVLNode *node, const string &hiName)
+    {
+        while (node)
+        {
+            if (node->data.itemName > hiName)
+                node = node->left;
+            else
+            {
+                result.add(node->data);
+                absorb(result, node->left);
+                node = node->right;
+            }
+        }
+    }
+
+    int countBelow(const string &itemName, bool inclusive) const
+    {
+        int count = 0;
+        const AVLNode *node = root;
+        while (node)
+        {
+            if (node->data.itemName < itemName || (inclusive && node->data.itemName == itemName))
+            {
+                count += size(node->left) + 1;
+                node = node->right;
+            }
+            else
+                node = node->left;
+        }
+        return count;
+    }
+
+public:
+    typedef TreeIterator<AVLNode> iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    AVL() : root(nullptr) {}
+
+    ~AVL()
+    {
+        vector<AVLNode *> pending;
+        if (root)
+            pending.push_back(root);
+        while (!pending.empty())
+        {
+            AVLNode *node = pending.back();
+            pending.pop_back();
+            if (node->left)
+                pending.push_back(node->left);
+            if (node->right)
+                pending.push_back(node->right);
+            pool.destroy(node);
+        }
+    }
+
+    void add(const Item &item)
+    {
+        insert(item);
+    }
+
+    void add(Item &&item)
+    {
+        insert(std::move(item));
+    }
+
+    void buildFrom(vector<Item> items)
+    {
+        auto byName = [](const Item &a, const Item &b) { return a.itemName < b.itemName; };
+        if (!is_sorted(items.begin(), items.end(), byName))
+            stable_sort(items.begin(), items.end(), byName);
+        items.erase(unique(items.begin(), items.end(), [](const Item &a, const Item &b)
+                           { return a.itemName == b.itemName; }),
+                    items.end());
+
+        vector<AVLNode *> nodes;
+        nodes.reserve(size() + items.size());
+        AVLNode *existing = leftmost(root);
+        for (auto &item : items)
+        {
+            for (; existing && existing->data.itemName < item.itemName; existing = nextInOrder(existing))
+                nodes.push_back(existing);
+            if (existing && existing->data.itemName == item.itemName)
+                continue;
+            nodes.push_back(pool.create(std::move(item)));
+            priceIndex.insert(&nodes.back()->data);
+        }
+        for (; existing; existing = nextInOrder(existing))
+            nodes.push_back(existing);
+
+        root = buildBalanced(nodes, 0, nodes.size(), nullptr);
+        finger.reset();
+    }
+
+    void unionWith(const AVL &other, int threads = 1)
+    {
+        if (&other == this)
+            return;
+        SetEffects effects;
+        AVLNode *newRoot = unionNodes(root, copyTree(other.root, nullptr), parallelDepth(threads), effects);
+        applyEffects(newRoot, effects);
+    }
+
+    void intersect(const AVL &other, int threads = 1)
+    {
+        if (&other == this)
+            return;
+        SetEffects effects;
+        AVLNode *newRoot = intersectNodes(root, other.root, parallelDepth(threads), effects);
+        applyEffects(newRoot, effects);
+    }
+
+    void difference(const AVL &other, int threads = 1)
+    {
+        SetEffects effects;
+        AVLNode *newRoot = &other == this ? intersectNodes(root, nullptr, 0, effects)
+                                          : differenceNodes(root, other.root, parallelDepth(threads), effects);
+        applyEffects(newRoot, effects);
+    }
+
+    int size() const
+    {
+        return size(root);
+    }
+
+    const Item *select(int k) const
+    {
+        const AVLNode *node = root;
+        while (node)
+        {
+            int leftSize = size(node->left);
+            if (k < leftSize)
+                node = node->left;
+            else if (k > leftSize)
+            {
+                k -= leftSize + 1;
+                node = node->right;
+            }
+            else
+                return &node->data;
+        }
+        return nullptr;
+    }
+
+    int rank(const string &itemName) const
+    {
+        return countBelow(itemName, false);
+    }
+
+    int countRange(const string &loName, const string &hiName) const
+    {
+        if (hiName < loName)
+            return 0;
+        return countBelow(hiName, true) - countBelow(loName, false);
+    }
+
+    PriceAggregate aggregate(const string &loName, const string &hiName) const
+    {
+        PriceAggregate result;
+        if (hiName < loName)
+            return result;
+
+        const AVLNode *node = root;
+        while (node && (node->data.itemName < loName || node->data.itemName > hiName))
+            node = node->data.itemName < loName ? node->right : node->left;
+        if (node)
+        {
+            result.add(node->data);
+            absorbFrom(result, node->left, loName);
+            absorbUpTo(result, node->right, hiName);
+        }
+        return result;
+    }
+
+    PriceAggregate aggregate() const
+    {
+        PriceAggregate result;
+        absorb(result, root);
+        return result;
+    }
+
+    void remove(const Item &item)
+    {
+        AVLNode *node = root;
+        while (node && node->data.itemName != item.itemName)
+            node = item < node->data ? node->left : node->right;
+        if (node)
+        {
+            finger.reset();
+            erase(node);
+        }
+    }
+
+    iterator begin() const
+    {
+        return iterator(leftmost<const AVLNode>(root), &root);
+    }
+
+    iterator end() const
+    {
+        return iterator(nullptr, &root);
+    }
+
+    reverse_iterator rbegin() const
+    {
+        return reverse_iterator(end());
+    }
+
+    reverse_iterator rend() const
+    {
+        return reverse_iterator(begin());
+    }
+
+    iterator lower_bound(const string &itemName) const
+    {
+        return iterator(lowerBoundNode<const AVLNode>(root, itemName, true), &root);
+    }
+
+    iterator upper_bound(const string &itemName) const
+    {
+        return iterator(lowerBoundNode<const AVLNode>(root, itemName, false), &root);
+    }
+
+    void display() const
+    {
+        for (const auto &item : *this)
+        {
+            item.print();
+        }
+    }
+
+    void displayInOrder(bool ascending = true) const
+    {
+        if (ascending)
+        {
+            display();
+            return;
+        }
+        for (auto it = rbegin(); it != rend(); ++it)
+        {
+            it->print();
+        }
+    }
+
+    void displayByPrice(bool ascending = true) const
+    {
+        printPriceIndex(priceIndex, ascending);
+    }
+
+    void displayPriceRange(int loPrice, int hiPrice) const
+    {
+        printPriceRange(priceIndex, loPrice, hiPrice);
+    }
+};
+
+class CompactAVLNode
+{
+public:
+    uint32_t left;
+    uint32_t right;
+    int8_t height;
+
+    CompactAVLNode() : left(0), right(0), height(0) {}
+};
+
+// Tree topology lives in one contiguous array of 12-byte nodes linked by
+// 32-bit indices; the Items sit in a parallel column at the same index.
+// Slot 0 is a height-0 sentinel standing in for null.
+class CompactAVL
+{
+private:
+    static const uint32_t Nil = 0;
+    static const int MaxHeight = 64;
+
+    vector<CompactAVLNode> nodes;
+    vector<Item> items;
+    uint32_t root;
+    uint32_t freeList;
+    int count;
+
+    int height(uint32_t node) const
+    {
+        return nodes[node].height;
+    }
+
+    int getBalance(uint32_t node) const
+    {
+        return height(nodes[node].left) - height(nodes[node].right);
+    }
+
+    void update(uint32_t node)
+    {
+        nodes[node].height = static_cast<int8_t>(max(height(nodes[node].left), height(nodes[node].right)) + 1);
+    }
+
+    uint32_t rightRotate(uint32_t y)
+    {
+        uint32_t x = nodes[y].left;
+        nodes[y].left = nodes[x].right;
+        nodes[x].right = y;
+        update(y);
+        update(x);
+        return x;
+    }
+
+    uint32_t leftRotate(uint32_t x)
+    {
+        uint32_t y = nodes[x].right;
+        nodes[x].right = nodes[y].left;
+        nodes[y].left = x;
+        update(x);
+        update(y);
+        return y;
+    }
+
+    uint32_t rebalance(uint32_t node)
+    {
+        update(node);
+
+        int balance = getBalance(node);
+
+        if (balance > 1)
+        {
+            if (getBalance(nodes[node].left) < 0)
+                nodes[node].left = leftRotate(nodes[node].left);
+            return rightRotate(node);
+        }
+
+        if (balance < -1)
+        {
+            if (getBalance(nodes[node].right) > 0)
+                nodes[node].right = rightRotate(nodes[node].right);
+            return leftRotate(node);
+        }
+
+        return node;
+    }
+
+    void replaceChild(uint32_t parent, uint32_t oldChild, uint32_t newChild)
+    {
+        if (parent == Nil)
+            root = newChild;
+        else if (nodes[parent].left == oldChild)
+            nodes[parent].left = newChild;
+        else
+            nodes[parent].right = newChild;
+    }
+
+    void retrace(const uint32_t *path, int depth)
+    {
+        while (depth--)
+        {
+            uint32_t node = path[depth];
+            int oldHeight = height(node);
+            uint32_t balanced = rebalance(node);
+            if (balanced != node)
+                replaceChild(depth ? path[depth - 1] : Nil, node, balanced);
+            if (height(balanced) == oldHeight)
+                return;
+        }
+    }
+
+    uint32_t allocate(Item &&item)
+    {
+        uint32_t node = freeList;
+        if (node != Nil)
+        {
+            freeList = nodes[node].left;
+            items[node] = std::move(item);
+        }
+        else
+        {
+            node = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+            items.push_back(std::move(item));
+        }
+        nodes[node].left = nodes[node].right = Nil;
+        nodes[node].height = 1;
+        return node;
+    }
+
+    void release(uint32_t node)
+    {
+        items[node] = Item("", "", 0);
+        nodes[node].left = freeList;
+        nodes[node].right = Nil;
+        nodes[node].height = 0;
+        freeList = node;
+    }
+
+    uint32_t findNode(const string &itemName) const
+    {
+        uint32_t node = root;
+        while (node != Nil)
+        {
+            int cmp = itemName.compare(items[node].itemName);
+            if (!cmp)
+                break;
+            node = cmp < 0 ? nodes[node].left : nodes[node].right;
+        }
+        return node;
+    }
+
+public:
+    CompactAVL() : nodes(1), items(1, Item("", "", 0)), root(Nil), freeList(Nil), count(0) {}
+
+    void reserve(int capacity)
+    {
+        nodes.reserve(capacity + 1);
+        items.reserve(capacity + 1);
+    }
+
+    // Takes item by value: it may refer into items, which allocate can grow.
+    void add(Item item)
+    {
+        uint32_t path[MaxHeight];
+        int depth = 0;
+
+        uint32_t node = root;
+        while (node != Nil)
+        {
+            int cmp = item.itemName.compare(items[node].itemName);
+            if (!cmp)
+                return;
+            path[depth++] = node;
+            node = cmp < 0 ? nodes[node].left : nodes[node].right;
+        }
+
+        uint32_t fresh = allocate(std::move(item));
+        if (!depth)
+            root = fresh;
+        else if (items[fresh] < items[path[depth - 1]])
+            nodes[path[depth - 1]].left = fresh;
+        else
+            nodes[path[depth - 1]].right = fresh;
+        ++count;
+        retrace(path, depth);
+    }
+
+    void remove(const Item &item)
+    {
+        uint32_t path[MaxHeight];
+        int depth = 0;
+
+        uint32_t node = root;
+        while (node != Nil)
+        {
+            int cmp = item.itemName.compare(items[node].itemName);
+            if (!cmp)
+                break;
+            path[depth++] = node;
+            node = cmp < 0 ? nodes[node].left : nodes[node].right;
+        }
+        if (node == Nil)
+            return;
+
+        uint32_t parent = depth ? path[depth - 1] : Nil;
+        if (nodes[node].left == Nil || nodes[node].right == Nil)
+            replaceChild(parent, node, nodes[node].left != Nil ? nodes[node].left : nodes[node].right);
+        else
+        {
+            int nodeDepth = depth;
+            path[depth++] = node;
+            uint32_t successor = nodes[node].right;
+            while (nodes[successor].left != Nil)
+            {
+                path[depth++] = successor;
+                successor = nodes[successor].left;
+            }
+
+            if (path[depth - 1] == node)
+                nodes[node].right = nodes[successor].right;
+            else
+                nodes[path[depth - 1]].left = nodes[successor].right;
+            nodes[successor].left = nodes[node].left;
+            nodes[successor].right = nodes[node].right;
+            nodes[successor].height = nodes[node].height;
+            replaceChild(parent, node, successor);
+            path[nodeDepth] = successor;
+        }
+        release(node);
+        --count;
+        retrace(path, depth);
+    }
+
+    bool contains(const string &itemName) const
+    {
+        return findNode(itemName) != Nil;
+    }
+
+    const Item *find(const string &itemName) const
+    {
+        uint32_t node = findNode(itemName);
+        return node != Nil ? &items[node] : nullptr;
+    }
+
+    int size() const
+    {
+        return count;
+    }
+
+    void displayInOrder(bool ascending = true) const
+    {
+        uint32_t pending[MaxHeight];
+        int depth = 0;
+        uint32_t node = root;
+        while (node != Nil || depth)
+        {
+            if (node != Nil)
+            {
+                pending[depth++] = node;
+                node = ascending ? nodes[node].left : nodes[node].right;
+            }
+            else
+            {
+                node = pending[--depth];
+                items[node].print();
+                node = ascending ? nodes[node].right : nodes[node].left;
+            }
+        }
+    }
+
+    void display() const
+    {
+        displayInOrder();
+    }
+};
+
+class PersistentAVLNode
+{
+public:
+    Item data;
+    shared_ptr<const PersistentAVLNode> left;
+    shared_ptr<const PersistentAVLNode> right;
+    int height;
+    int size;
+
+    PersistentAVLNode(Item item, shared_ptr<const PersistentAVLNode> left, shared_ptr<const PersistentAVLNode> right)
+        : data(std::move(item)), left(std::move(left)), right(std::move(right)),
+          height(1 + max(this->left ? this->left->height : 0, this->right ? this->right->height : 0)),
+          size(1 + (this->left ? this->left->size : 0) + (this->right ? this->right->size : 0)) {}
+};
+
+class PersistentAVL
+{
+public:
+    typedef shared_ptr<const PersistentAVLNode> Version;
+
+private:
+    Version root;
+    mutex writeLock;
+
+    static int height(const Version &node)
+    {
+        return node ? node->height : 0;
+    }
+
+    static Version make(const Item &item, Version left, Version right)
+    {
+        return make_shared<const PersistentAVLNode>(item, std::move(left), std::move(right));
+    }
+
+    static Version balance(const Item &item, const Version &left, const Version &right)
+    {
+        if (height(left) > height(right) + 1)
+        {
+            if (height(left->left) >= height(left->right))
+                return make(left->data, left->left, make(item, left->right, right));
+            const Version &pivot = left->right;
+            return make(pivot->data, make(left->data, left->left, pivot->left), make(item, pivot->right, right));
+        }
+
+        if (height(right) > height(left) + 1)
+        {
+            if (height(right->right) >= height(right->left))
+                return make(right->data, make(item, left, right->left), right->right);
+            const Version &pivot = right->left;
+            return make(pivot->data, make(item, left, pivot->left), make(right->data, pivot->right, right->right));
+        }
+
+        return make(item, left, right);
+    }
+
+    static Version addHelper(const Version &node, const Item &item)
+    {
+        if (!node)
+            return make(item, nullptr, nullptr);
+
+        if (item < node->data)
+        {
+            Version left = addHelper(node->left, item);
+            return left == node->left ? node : balance(node->data, left, node->right);
+        }
+        if (item > node->data)
+        {
+            Version right = addHelper(node->right, item);
+            return right == node->right ? node : balance(node->data, node->left, right);
+        }
+        return node;
+    }
+
+    static Version removeMin(const Version &node, const PersistentAVLNode *&minNode)
+    {
+        if (!node->left)
+        {
+            minNode = node.get();
+            return node->right;
+        }
+        return balance(node->data, removeMin(node->left, minNode), node->right);
+    }
+
+    static Version removeHelper(const Version &node, const Item &item)
+    {
+        if (!node)
+            return node;
+
+        if (item < node->data)
+        {
+            Version left = removeHelper(node->left, item);
+            return left == node->left ? node : balance(node->data, left, node->right);
+        }
+        if (item > node->data)
+        {
+            Version right = removeHelper(node->right, item);
+            return right == node->right ? node : balance(node->data, node->left, right);
+        }
+
+        if (!node->left)
+            return node->right;
+        if (!node->right)
+            return node->left;
+
+        const PersistentAVLNode *successor;
+        Version right = removeMin(node->right, successor);
+        return balance(successor->data, node->left, right);
+    }
+
+public:
+    PersistentAVL() {}
+
+    void add(const Item &item)
+    {
+        lock_guard<mutex> guard(writeLock);
+        atomic_store(&root, addHelper(root, item));
+    }
+
+    void remove(const Item &item)
+    {
+        lock_guard<mutex> guard(writeLock);
+        atomic_store(&root, removeHelper(root, item));
+    }
+
+    Version snapshot() const
+    {
+        return atomic_load(&root);
+    }
+
+    int size() const
+    {
+        Version version = snapshot();
+        return version ? version->size : 0;
+    }
+
+    static void display(const Version &version, bool ascending = true)
+    {
+        vector<const PersistentAVLNode *> pending;
+        const PersistentAVLNode *node = version.get();
+        while (node || !pending.empty())
+        {
+            while (node)
+            {
+                pending.push_back(node);
+                node = ascending ? node->left.get() : node->right.get();
+            }
+            node = pending.back();
+            pending.pop_back();
+            node->data.print();
+            node = ascending ? node->right.get() : node->left.get();
+        }
+    }
+
+    void display() const
+    {
+        display(snapshot());
+    }
+
+    void displayInOrder(bool ascending = true) const
+    {
+        display(snapshot(), ascending);
+    }
+};
+
+// Gives every thread its own cache-line-aligned Record, created on the
+// thread's first call to local() and kept until the registry is destroyed.
+// Any thread may walk the records; each should be written only by its owner.
+template <class Record>
+class ThreadRegistry
+{
+private:
+    struct alignas(64) Slot
+    {
+        Record record;
+        Slot *next;
+
+        Slot() : next(nullptr) {}
+    };
+
+    const unsigned long long id;
+    atomic<Slot *> slots;
+
+    static unsigned long long nextId()
+    {
+        static atomic<unsigned long long> next(0);
+        return ++next;
+    }
+
+public:
+    ThreadRegistry() : id(nextId()), slots(nullptr) {}
+
+    ThreadRegistry(const ThreadRegistry &) = delete;
+    ThreadRegistry &operator=(const ThreadRegistry &) = delete;
+
+    ~ThreadRegistry()
+    {
+        Slot *slot = slots.load();
+        while (slot)
+        {
+            Slot *next = slot->next;
+            slot->~Slot();
+            LineAlignedAllocator<Slot>().deallocate(slot, 1);
+            slot = next;
+        }
+    }
+
+    // Ids are never reused, so the entries a thread keeps for destroyed
+    // registries are never looked up again.
+    Record &local()
+    {
+        static thread_local unsigned long long cachedId = 0;
+        static thread_local Slot *cached = nullptr;
+        static thread_local unordered_map<unsigned long long, Slot *> registered;
+        if (cachedId == id)
+            return cached->record;
+
+        Slot *&slot = registered[id];
+        if (!slot)
+        {
+            slot = new (LineAlignedAllocator<Slot>().allocate(1)) Slot();
+            Slot *head = slots.load();
+            do
+                slot->next = head;
+            while (!slots.compare_exchange_weak(head, slot));
+        }
+        cachedId = id;
+        cached = slot;
+        return slot->record;
+    }
+
+    template <class Visit>
+    void forEach(Visit visit) const
+    {
+        for (Slot *slot = slots.load(); slot; slot = slot->next)
+            visit(slot->record);
+    }
+};
+
+// Epoch-based reclamation. A thread pins the current epoch while it reads
+// shared memory through a Guard; memory retired during epoch e is freed by
+// the thread that retired it once the epoch reaches e + 2, when no pinned
+// reader can still reach it. Retire lists are kept per thread, so retiring
+// never contends on a shared lock.
+class EpochReclaimer
+{
+private:
+    struct Retired
+    {
+        unsigned long long epoch;
+        void *pointer;
+        void (*destroy)(void *);
+    };
+
+    struct Participant
+    {
+        atomic<unsigned long long> pinned; // 0 while outside a Guard
+        vector<Retired> retired;
+        size_t collectAt;
+
+        Participant() : pinned(0), collectAt(CollectBatch) {}
+    };
+
+    static const size_t CollectBatch = 64;
+
+    atomic<unsigned long long> epoch;
+    ThreadRegistry<Participant> participants;
+
+    template <class T>
+    static void destroy(void *pointer)
+    {
+        delete static_cast<T *>(pointer);
+    }
+
+    // The epoch advances only once every pinned thread has observed it.
+    void tryAdvance()
+    {
+        unsigned long long current = epoch.load();
+        bool behind = false;
+        participants.forEach([&](const Participant &participant)
+                             {
+            unsigned long long pinned = participant.pinned.load();
+            if (pinned && pinned != current)
+                behind = true; });
+        if (!behind)
+            epoch.compare_exchange_strong(current, current + 1);
+    }
+
+    void collect(Participant &participant)
+    {
+        tryAdvance();
+        unsigned long long current = epoch.load();
+        vector<Retired> &retired = participant.retired;
+        auto kept = retired.begin();
+        for (const Retired &entry : retired)
+        {
+            if (entry.epoch + 2 <= current)
+                entry.destroy(entry.pointer);
+            else
+                *kept++ = entry;
+        }
+        retired.erase(kept, retired.end());
+        participant.collectAt = retired.size() + CollectBatch;
+    }
+
+public:
+    // Pins the calling thread for the guard's lifetime. Guards do not nest.
+    class Guard
+    {
+    public:
+        explicit Guard(EpochReclaimer &reclaimer) : participant(reclaimer.participants.local())
+        {
+            participant.pinned.store(reclaimer.epoch.load());
+        }
+
+        ~Guard()
+        {
+            participant.pinned.store(0);
+        }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+    private:
+        Participant &participant;
+    };
+
+    EpochReclaimer() : epoch(1) {}
+
+    EpochReclaimer(const EpochReclaimer &) = delete;
+    EpochReclaimer &operator=(const EpochReclaimer &) = delete;
+
+    ~EpochReclaimer()
+    {
+        participants.forEach([](const Participant &participant)
+                             {
+            for (const Retired &entry : participant.retired)
+                entry.destroy(entry.pointer); });
+    }
+
+    // Frees pointer once no thread pinned now can still be reading it. The
+    // caller must already have unlinked it from the shared structure.
+    template <class T>
+    void retire(T *pointer)
+    {
+        Participant &participant = participants.local();
+        participant.retired.push_back(Retired{epoch.load(), pointer, &destroy<T>});
+        if (participant.retired.size() >= participant.collectAt)
+            collect(participant);
+    }
+};
+
+class ConcurrentAVLNode
+{
+public:
+    const string key;
+    atomic<Item *> value;
+    atomic<int> height;
+    atomic<long long> version;
+    atomic<ConcurrentAVLNode *> parent;
+    atomic<ConcurrentAVLNode *> left;
+    atomic<ConcurrentAVLNode *> right;
+    mutex lock;
+
+    ConcurrentAVLNode(string key, Item *value, ConcurrentAVLNode *parent)
+        : key(std::move(key)), value(value), height(1), version(0), parent(parent), left(nullptr), right(nullptr) {}
+
+    atomic<ConcurrentAVLNode *> &child(int dir)
+    {
+        return dir < 0 ? left : right;
+    }
+};
+
+// attemptUnlink, fixHeight, rebalance* and rotate* change links and heights
+// directly, so callers must already hold the locks they touch: node's for
+// fixHeight, parent's and node's for the others. The rebalance helpers lock
+// the children they rotate before calling a rotation.
+class ConcurrentAVL
+{
+private:
+    typedef ConcurrentAVLNode Node;
+
+    static const long long Unlinked = 1;
+    static const long long Shrinking = 2;
+
+    static const int UnlinkRequired = -1;
+    static const int RebalanceRequired = -2;
+    static const int NothingRequired = -3;
+
+    enum Outcome
+    {
+        Retry,
+        Unchanged,
+        Changed
+    };
+
+    // Each thread counts its own adds and removes; size() sums them.
+    struct SizeDelta
+    {
+        atomic<long long> delta;
+
+        SizeDelta() : delta(0) {}
+    };
+
+    Node rootHolder;
+    mutable EpochReclaimer reclaimer;
+    ThreadRegistry<SizeDelta> sizeDeltas;
+
+    static int height(const Node *node)
+    {
+        return node ? node->height.load() : 0;
+    }
+
+    static bool isShrinking(long long version)
+    {
+        return (version & Shrinking) != 0;
+    }
+
+    static bool isUnlinked(long long version)
+    {
+        return (version & Unlinked) != 0;
+    }
+
+    static long long beginChange(long long version)
+    {
+        return version | Shrinking;
+    }
+
+    static long long endChange(long long version)
+    {
+        return (version | Shrinking | Unlinked) + 1;
+    }
+
+    void countChange(long long change)
+    {
+        atomic<long long> &delta = sizeDeltas.local().delta;
+        delta.store(delta.load(memory_order_relaxed) + change, memory_order_relaxed);
+    }
+
+    static void waitUntilNotChanging(Node *node)
+    {
+        while (isShrinking(node->version.load()))
+            this_thread::yield();
+    }
+
+    Outcome attemptGet(const string &itemName, Node *node, int dir, long long nodeVersion, Item *&found)
+    {
+        for (;;)
+        {
+            Node *child = node->child(dir).load();
+            if (node->version.load() != nodeVersion)
+                return Retry;
+            if (!child)
+                return Unchanged;
+
+            int nextDir = itemName.compare(child->key);
+            if (!nextDir)
+            {
+                found = child->value.load();
+                return found ? Changed : Unchanged;
+            }
+
+            long long childVersion = child->version.load();
+            if (isShrinking(childVersion))
+                waitUntilNotChanging(child);
+            else if (!isUnlinked(childVersion) && child == node->child(dir).load())
+            {
+                if (node->version.load() != nodeVersion)
+                    return Retry;
+                Outcome outcome = attemptGet(itemName, child, nextDir, childVersion, found);
+                if (outcome != Retry)
+                    return outcome;
+            }
+        }
+    }
+
+    Outcome attemptInsertIntoEmpty(const Item &item, Node *node, int dir, long long nodeVersion)
+    {
+        {
+            lock_guard<mutex> guard(node->lock);
+            if (node->version.load() != nodeVersion || node->child(dir).load())
+                return Retry;
+            node->child(dir).store(new Node(item.itemName, new Item(item), node));
+        }
+        fixHeightAndRebalance(node);
+        return Changed;
+    }
+
+    Outcome attemptRevive(const Item &item, Node *node)
+    {
+        lock_guard<mutex> guard(node->lock);
+        if (isUnlinked(node->version.load()))
+            return Retry;
+        if (node->value.load())
+            return Unchanged;
+        node->value.store(new Item(item));
+        return Changed;
+    }
+
+    Outcome attemptAdd(const Item &item, Node *node, int dir, long long nodeVersion)
+    {
+        for (;;)
+        {
+            Node *child = node->child(dir).load();
+            if (node->version.load() != nodeVersion)
+                return Retry;
+
+            Outcome outcome = Retry;
+            if (!child)
+                outcome = attemptInsertIntoEmpty(item, node, dir, nodeVersion);
+            else
+            {
+                int nextDir = item.itemName.compare(child->key);
+                if (!nextDir)
+                    outcome = attemptRevive(item, child);
+                else
+                {
+                    long long childVersion = child->version.load();
+                    if (isShrinking(childVersion))
+                        waitUntilNotChanging(child);
+                    else if (!isUnlinked(childVersion) && child == node->child(dir).load())
+                    {
+                        if (node->version.load() != nodeVersion)
+                            return Retry;
+                        outcome = attemptAdd(item, child, nextDir, childVersion);
+                    }
+                }
+            }
+            if (outcome != Retry)
+                return outcome;
+        }
+    }
+
+    bool attemptUnlink(Node *parent, Node *node)
+    {
+        Node *parentLeft = parent->left.load();
+        Node *parentRight = parent->right.load();
+        if (parentLeft != node && parentRight != node)
+            return false;
+
+        Node *left = node->left.load();
+        Node *right = node->right.load();
+        if (left && right)
+            return false;
+
+        Node *splice = left ? left : right;
+        if (parentLeft == node)
+            parent->left.store(splice);
+        else
+            parent->right.store(splice);
+        if (splice)
+            splice->parent.store(parent);
+
+        node->version.store(Unlinked);
+        node->value.store(nullptr);
+        reclaimer.retire(node);
+        return true;
+    }
+
+    Outcome attemptRemoveNode(Node *parent, Node *node)
+    {
+        if (!node->value.load())
+            return Unchanged;
+
+        Item *previous;
+        if (!node->left.load() || !node->right.load())
+        {
+            {
+                lock_guard<mutex> parentGuard(parent->lock);
+                if (isUnlinked(parent->version.load()) || node->parent.load() != parent)
+                    return Retry;
+
+                lock_guard<mutex> guard(node->lock);
+                previous = node->value.load();
+                if (!previous)
+                    return Unchanged;
+                if (node->left.load() && node->right.load())
+                    node->value.store(nullptr);
+                else if (!attemptUnlink(parent, node))
+                    return Retry;
+            }
+            fixHeightAndRebalance(parent);
         }
-    }
-
-    void heapifyUp(int index, bool sortByName = true, bool ascending = true) {
-        if (index && compare(heap[index], heap[parent(index)], sortByName, ascending)) {
-            swap(heap[index], heap[parent(index)]);
-            heapifyUp(parent(index), sortByName, ascending);
+        else
+        {
+            lock_guard<mutex> guard(node->lock);
+            if (isUnlinked(node->version.load()))
+                return Retry;
+            previous = node->value.load();
+            if (!previous)
+                return Unchanged;
+            if (!node->left.load() || !node->right.load())
+                return Retry;
+            node->value.store(nullptr);
         }
-    }
-
-    void heapifyDown(int index, bool sortByName = true, bool ascending = true) {
-        int leftChild = left(index);
-        int rightChild = right(index);
-        int smallestOrLargest = index;
 
-        if (leftChild < size() && compare(heap[leftChild], heap[index], sortByName, ascending))
-            smallestOrLargest = leftChild;
-
-        if (rightChild < size() && compare(heap[rightChild], heap[smallestOrLargest], sortByName, ascending))
-            smallestOrLargest = rightChild;
+        reclaimer.retire(previous);
+        return Changed;
+    }
 
-        if (smallestOrLargest != index) {
-            swap(heap[index], heap[smallestOrLargest]);
-            heapifyDown(smallestOrLargest, sortByName, ascending);
+    Outcome attemptRemove(const string &itemName, Node *node, int dir, long long nodeVersion)
+    {
+        for (;;)
+        {
+            Node *child = node->child(dir).load();
+            if (node->version.load() != nodeVersion)
+                return Retry;
+            if (!child)
+                return Unchanged;
+
+            Outcome outcome = Retry;
+            int nextDir = itemName.compare(child->key);
+            if (!nextDir)
+                outcome = attemptRemoveNode(node, child);
+            else
+            {
+                long long childVersion = child->version.load();
+                if (isShrinking(childVersion))
+                    waitUntilNotChanging(child);
+                else if (!isUnlinked(childVersion) && child == node->child(dir).load())
+                {
+                    if (node->version.load() != nodeVersion)
+                        return Retry;
+                    outcome = attemptRemove(itemName, child, nextDir, childVersion);
+                }
+            }
+            if (outcome != Retry)
+                return outcome;
         }
     }
 
-
-
-public:
-    bool isMinHeap;
-    Heap(bool minHeap = true) : isMinHeap(minHeap) {}
-
-    void add(Item item)
+    static int nodeCondition(Node *node)
     {
-        heap.push_back(item);
-        heapifyUp(size() - 1);
+        Node *left = node->left.load();
+        Node *right = node->right.load();
+        if ((!left || !right) && !node->value.load())
+            return UnlinkRequired;
+
+        int heightNow = node->height.load();
+        int leftHeight = height(left);
+        int rightHeight = height(right);
+        int heightRepl = 1 + max(leftHeight, rightHeight);
+        int balance = leftHeight - rightHeight;
+        if (balance < -1 || balance > 1)
+            return RebalanceRequired;
+        return heightNow != heightRepl ? heightRepl : NothingRequired;
     }
 
-    void remove()
+    void fixHeightAndRebalance(Node *node)
     {
-        if (size())
+        // Once a rotation or unlink has happened, the repair may stop below an
+        // ancestor whose height went stale, so keep climbing to the root.
+        bool restructured = false;
+        while (node && node->parent.load())
         {
-            heap[0] = heap.back();
-            heap.pop_back();
-            heapifyDown(0);
+            if (isUnlinked(node->version.load()))
+                return;
+            Node *parent = node->parent.load();
+            int condition = nodeCondition(node);
+
+            Node *next = nullptr;
+            if (condition == NothingRequired)
+                ;
+            else if (condition != UnlinkRequired && condition != RebalanceRequired)
+            {
+                lock_guard<mutex> guard(node->lock);
+                next = fixHeight(node);
+            }
+            else
+            {
+                restructured = true;
+                next = node;
+                lock_guard<mutex> parentGuard(parent->lock);
+                if (!isUnlinked(parent->version.load()) && node->parent.load() == parent)
+                {
+                    lock_guard<mutex> guard(node->lock);
+                    next = rebalance(parent, node);
+                }
+            }
+            if (!next)
+            {
+                if (!restructured)
+                    return;
+                next = parent;
+            }
+            node = next;
         }
     }
 
-    void display() const
+    static Node *fixHeight(Node *node)
     {
-        for (const auto &item : heap)
+        int condition = nodeCondition(node);
+        switch (condition)
         {
-            item.print();
+        case RebalanceRequired:
+        case UnlinkRequired:
+            return node;
+        case NothingRequired:
+            return nullptr;
+        default:
+            node->height.store(condition);
+            return node->parent.load();
         }
     }
 
-    int size() const
+    Node *rebalance(Node *parent, Node *node)
     {
-        return heap.size();
+        Node *left = node->left.load();
+        Node *right = node->right.load();
+        if ((!left || !right) && !node->value.load())
+            return attemptUnlink(parent, node) ? fixHeight(parent) : node;
+
+        int heightNow = node->height.load();
+        int leftHeight = height(left);
+        int rightHeight = height(right);
+        int heightRepl = 1 + max(leftHeight, rightHeight);
+        int balance = leftHeight - rightHeight;
+
+        if (balance > 1)
+            return rebalanceToRight(parent, node, left, rightHeight);
+        if (balance < -1)
+            return rebalanceToLeft(parent, node, right, leftHeight);
+        if (heightRepl != heightNow)
+        {
+            node->height.store(heightRepl);
+            return fixHeight(parent);
+        }
+        return nullptr;
     }
 
-    void heapSortBy(bool sortByName = true, bool ascending = true)
+    Node *rebalanceToRight(Node *parent, Node *node, Node *left, int rightHeight)
     {
-        vector<Item> originalHeap = heap;
-        vector<Item> sorted;
-
-        while (size()) {
-            sorted.push_back(heap[0]);
-            heap[0] = heap.back();
-            heap.pop_back();
-            heapifyDown(0, sortByName, ascending);
-        }
+        lock_guard<mutex> leftGuard(left->lock);
+        int leftHeight = left->height.load();
+        if (leftHeight - rightHeight <= 1)
+            return node;
 
-        heap = originalHeap;
+        Node *leftRight = left->right.load();
+        int leftLeftHeight = height(left->left.load());
+        int leftRightHeight = height(leftRight);
+        if (leftLeftHeight >= leftRightHeight)
+            return rotateRight(parent, node, left, rightHeight, leftLeftHeight, leftRight, leftRightHeight);
 
-        for (const auto &item : sorted) {
-            item.print();
+        {
+            lock_guard<mutex> leftRightGuard(leftRight->lock);
+            leftRightHeight = leftRight->height.load();
+            if (leftLeftHeight >= leftRightHeight)
+                return rotateRight(parent, node, left, rightHeight, leftLeftHeight, leftRight, leftRightHeight);
+
+            int leftRightLeftHeight = height(leftRight->left.load());
+            int balance = leftLeftHeight - leftRightLeftHeight;
+            if (balance >= -1 && balance <= 1)
+                return rotateRightOverLeft(parent, node, left, rightHeight, leftLeftHeight, leftRight, leftRightLeftHeight);
         }
+        return rebalanceToLeft(node, left, leftRight, leftLeftHeight);
     }
-};
-
-class AVLNode
-{
-public:
-    Item data;
-    AVLNode *left;
-    AVLNode *right;
-    int height;
-
-    AVLNode(Item item) : data(item), left(nullptr), right(nullptr), height(1) {}
-};
-
-class AVL
-{
-private:
-    AVLNode *root;
 
-    int height(AVLNode *node)
+    Node *rebalanceToLeft(Node *parent, Node *node, Node *right, int leftHeight)
     {
-        return node ? node->height : 0;
-    }
+        lock_guard<mutex> rightGuard(right->lock);
+        int rightHeight = right->height.load();
+        if (leftHeight - rightHeight >= -1)
+            return node;
 
-    int getBalance(AVLNode *node)
-    {
-        return node ? height(node->left) - height(node->right) : 0;
-    }
+        Node *rightLeft = right->left.load();
+        int rightLeftHeight = height(rightLeft);
+        int rightRightHeight = height(right->right.load());
+        if (rightRightHeight >= rightLeftHeight)
+            return rotateLeft(parent, node, leftHeight, right, rightLeft, rightLeftHeight, rightRightHeight);
 
-    AVLNode *rightRotate(AVLNode *y)
-    {
-        AVLNode *x = y->left;
-        AVLNode *T2 = x->right;
-        x->right = y;
-        y->left = T2;
-        y->height = max(height(y->left), height(y->right)) + 1;
-        x->height = max(height(x->left), height(x->right)) + 1;
-        return x;
+        {
+            lock_guard<mutex> rightLeftGuard(rightLeft->lock);
+            rightLeftHeight = rightLeft->height.load();
+            if (rightRightHeight >= rightLeftHeight)
+                return rotateLeft(parent, node, leftHeight, right, rightLeft, rightLeftHeight, rightRightHeight);
+
+            int rightLeftRightHeight = height(rightLeft->right.load());
+            int balance = rightRightHeight - rightLeftRightHeight;
+            if (balance >= -1 && balance <= 1)
+                return rotateLeftOverRight(parent, node, leftHeight, right, rightLeft, rightRightHeight, rightLeftRightHeight);
+        }
+        return rebalanceToRight(node, right, rightLeft, rightRightHeight);
     }
 
-    AVLNode *leftRotate(AVLNode *x)
+    static void replaceChild(Node *parent, Node *oldChild, Node *newChild)
     {
-        AVLNode *y = x->right;
-        AVLNode *T2 = y->left;
-        y->left = x;
-        x->right = T2;
-        x->height = max(height(x->left), height(x->right)) + 1;
-        y->height = max(height(y->left), height(y->right)) + 1;
-        return y;
+        if (parent->left.load() == oldChild)
+            parent->left.store(newChild);
+        else
+            parent->right.store(newChild);
+        newChild->parent.store(parent);
     }
 
-    AVLNode *addHelper(AVLNode *node, Item item)
+    Node *rotateRight(Node *parent, Node *node, Node *left, int rightHeight, int leftLeftHeight,
+                      Node *leftRight, int leftRightHeight)
     {
-        if (!node)
-            return new AVLNode(item);
+        long long nodeVersion = node->version.load();
+        node->version.store(beginChange(nodeVersion));
 
-        if (item < node->data)
-            node->left = addHelper(node->left, item);
-        else if (item > node->data)
-            node->right = addHelper(node->right, item);
-        else
-            return node;
+        node->left.store(leftRight);
+        if (leftRight)
+            leftRight->parent.store(node);
+        left->right.store(node);
+        node->parent.store(left);
+        replaceChild(parent, node, left);
 
-        node->height = 1 + max(height(node->left), height(node->right));
+        int nodeHeight = 1 + max(leftRightHeight, rightHeight);
+        node->height.store(nodeHeight);
+        left->height.store(1 + max(leftLeftHeight, nodeHeight));
 
-        int balance = getBalance(node);
+        node->version.store(endChange(nodeVersion));
 
-        if (balance > 1 && item < node->left->data)
-            return rightRotate(node);
+        int nodeBalance = leftRightHeight - rightHeight;
+        if (nodeBalance < -1 || nodeBalance > 1)
+            return node;
+        if ((!leftRight || rightHeight == 0) && !node->value.load())
+            return node;
+        int leftBalance = leftLeftHeight - nodeHeight;
+        if (leftBalance < -1 || leftBalance > 1)
+            return left;
+        if (leftLeftHeight == 0 && !left->value.load())
+            return left;
+        return fixHeight(parent);
+    }
 
-        if (balance < -1 && item > node->right->data)
-            return leftRotate(node);
+    Node *rotateLeft(Node *parent, Node *node, int leftHeight, Node *right, Node *rightLeft,
+                     int rightLeftHeight, int rightRightHeight)
+    {
+        long long nodeVersion = node->version.load();
+        node->version.store(beginChange(nodeVersion));
 
-        if (balance > 1 && item > node->left->data)
-        {
-            node->left = leftRotate(node->left);
-            return rightRotate(node);
-        }
+        node->right.store(rightLeft);
+        if (rightLeft)
+            rightLeft->parent.store(node);
+        right->left.store(node);
+        node->parent.store(right);
+        replaceChild(parent, node, right);
 
-        if (balance < -1 && item < node->right->data)
-        {
-            node->right = rightRotate(node->right);
-            return leftRotate(node);
-        }
+        int nodeHeight = 1 + max(leftHeight, rightLeftHeight);
+        node->height.store(nodeHeight);
+        right->height.store(1 + max(nodeHeight, rightRightHeight));
 
-        return node;
-    }
+        node->version.store(endChange(nodeVersion));
 
-    AVLNode *minValueNode(AVLNode *node)
-    {
-        AVLNode *current = node;
-        while (current->left != nullptr)
-            current = current->left;
-        return current;
+        int nodeBalance = rightLeftHeight - leftHeight;
+        if (nodeBalance < -1 || nodeBalance > 1)
+            return node;
+        if ((!rightLeft || leftHeight == 0) && !node->value.load())
+            return node;
+        int rightBalance = rightRightHeight - nodeHeight;
+        if (rightBalance < -1 || rightBalance > 1)
+            return right;
+        if (rightRightHeight == 0 && !right->value.load())
+            return right;
+        return fixHeight(parent);
     }
 
-    AVLNode *removeHelper(AVLNode *root, Item item)
+    Node *rotateRightOverLeft(Node *parent, Node *node, Node *left, int rightHeight, int leftLeftHeight,
+                              Node *leftRight, int leftRightLeftHeight)
     {
-        if (!root)
-            return root;
-
-        if (item < root->data)
-            root->left = removeHelper(root->left, item);
-        else if (item > root->data)
-            root->right = removeHelper(root->right, item);
-        else
+        long long nodeVersion = node->version.load();
+        long long leftVersion = left->version.load();
+
+        Node *leftRightLeft = leftRight->left.load();
+        Node *leftRightRight = leftRight->right.load();
+        int leftRightRightHeight = height(leftRightRight);
+
+        node->version.store(beginChange(nodeVersion));
+        left->version.store(beginChange(leftVersion));
+
+        node->left.store(leftRightRight);
+        if (leftRightRight)
+            leftRightRight->parent.store(node);
+        left->right.store(leftRightLeft);
+        if (leftRightLeft)
+            leftRightLeft->parent.store(left);
+        leftRight->left.store(left);
+        left->parent.store(leftRight);
+        leftRight->right.store(node);
+        node->parent.store(leftRight);
+        replaceChild(parent, node, leftRight);
+
+        int nodeHeight = 1 + max(leftRightRightHeight, rightHeight);
+        node->height.store(nodeHeight);
+        int leftHeight = 1 + max(leftLeftHeight, leftRightLeftHeight);
+        left->height.store(leftHeight);
+        leftRight->height.store(1 + max(leftHeight, nodeHeight));
+
+        node->version.store(endChange(nodeVersion));
+        left->version.store(endChange(leftVersion));
+
+        if ((leftLeftHeight == 0 || leftRightLeftHeight == 0) && !left->value.load())
         {
-            if ((!root->left) || (!root->right))
-            {
-                AVLNode *temp = root->left ? root->left : root->right;
-                if (!temp)
-                {
-                    temp = root;
-                    root = nullptr;
-                }
-                else
-                    *root = *temp;
-                delete temp;
-            }
-            else
-            {
-                AVLNode *temp = minValueNode(root->right);
-                root->data = temp->data;
-                root->right = removeHelper(root->right, temp->data);
-            }
+            attemptUnlink(leftRight, left);
+            leftHeight = height(leftRight->left.load());
+            leftRight->height.store(1 + max(leftHeight, nodeHeight));
         }
 
-        if (!root)
-            return root;
-
-        root->height = 1 + max(height(root->left), height(root->right));
-
-        int balance = getBalance(root);
-
-        if (balance > 1 && getBalance(root->left) >= 0)
-            return rightRotate(root);
+        int nodeBalance = leftRightRightHeight - rightHeight;
+        if (nodeBalance < -1 || nodeBalance > 1)
+            return node;
+        if ((!leftRightRight || rightHeight == 0) && !node->value.load())
+            return node;
+        int leftRightBalance = leftHeight - nodeHeight;
+        if (leftRightBalance < -1 || leftRightBalance > 1)
+            return leftRight;
+        return fixHeight(parent);
+    }
 
-        if (balance > 1 && getBalance(root->left) < 0)
+    Node *rotateLeftOverRight(Node *parent, Node *node, int leftHeight, Node *right, Node *rightLeft,
+                              int rightRightHeight, int rightLeftRightHeight)
+    {
+        long long nodeVersion = node->version.load();
+        long long rightVersion = right->version.load();
+
+        Node *rightLeftLeft = rightLeft->left.load();
+        Node *rightLeftRight = rightLeft->right.load();
+        int rightLeftLeftHeight = height(rightLeftLeft);
+
+        node->version.store(beginChange(nodeVersion));
+        right->version.store(beginChange(rightVersion));
+
+        node->right.store(rightLeftLeft);
+        if (rightLeftLeft)
+            rightLeftLeft->parent.store(node);
+        right->left.store(rightLeftRight);
+        if (rightLeftRight)
+            rightLeftRight->parent.store(right);
+        rightLeft->right.store(right);
+        right->parent.store(rightLeft);
+        rightLeft->left.store(node);
+        node->parent.store(rightLeft);
+        replaceChild(parent, node, rightLeft);
+
+        int nodeHeight = 1 + max(leftHeight, rightLeftLeftHeight);
+        node->height.store(nodeHeight);
+        int rightHeight = 1 + max(rightLeftRightHeight, rightRightHeight);
+        right->height.store(rightHeight);
+        rightLeft->height.store(1 + max(nodeHeight, rightHeight));
+
+        node->version.store(endChange(nodeVersion));
+        right->version.store(endChange(rightVersion));
+
+        if ((rightRightHeight == 0 || rightLeftRightHeight == 0) && !right->value.load())
         {
-            root->left = leftRotate(root->left);
-            return rightRotate(root);
+            attemptUnlink(rightLeft, right);
+            rightHeight = height(rightLeft->right.load());
+            rightLeft->height.store(1 + max(nodeHeight, rightHeight));
         }
 
-        if (balance < -1 && getBalance(root->right) <= 0)
-            return leftRotate(root);
+        int nodeBalance = rightLeftLeftHeight - leftHeight;
+        if (nodeBalance < -1 || nodeBalance > 1)
+            return node;
+        if ((!rightLeftLeft || leftHeight == 0) && !node->value.load())
+            return node;
+        int rightLeftBalance = rightHeight - nodeHeight;
+        if (rightLeftBalance < -1 || rightLeftBalance > 1)
+            return rightLeft;
+        return fixHeight(parent);
+    }
 
-        if (balance < -1 && getBalance(root->right) > 0)
+    // The returned item stays valid only while the caller's Guard is alive.
+    Item *get(const string &itemName)
+    {
+        for (;;)
         {
-            root->right = rightRotate(root->right);
-            return leftRotate(root);
+            Item *found = nullptr;
+            Outcome outcome = attemptGet(itemName, &rootHolder, 1, rootHolder.version.load(), found);
+            if (outcome != Retry)
+                return outcome == Changed ? found : nullptr;
         }
-
-        return root;
     }
 
-    void inOrderHelper(AVLNode *node, vector<Item> &items) const
+    static void displayHelper(Node *node)
     {
         if (node)
         {
-            inOrderHelper(node->left, items);
-            items.push_back(node->data);
-            inOrderHelper(node->right, items);
+            displayHelper(node->left.load());
+            if (Item *item = node->value.load())
+                item->print();
+            displayHelper(node->right.load());
         }
     }
 
 public:
-    AVL() : root(nullptr) {}
+    ConcurrentAVL() : rootHolder("", nullptr, nullptr) {}
 
-    void add(Item item)
+    ConcurrentAVL(const ConcurrentAVL &) = delete;
+    ConcurrentAVL &operator=(const ConcurrentAVL &) = delete;
+
+    ~ConcurrentAVL()
     {
-        root = addHelper(root, item);
+        vector<Node *> pending;
+        if (Node *root = rootHolder.right.load())
+            pending.push_back(root);
+        while (!pending.empty())
+        {
+            Node *node = pending.back();
+            pending.pop_back();
+            if (Node *left = node->left.load())
+                pending.push_back(left);
+            if (Node *right = node->right.load())
+                pending.push_back(right);
+            delete node->value.load();
+            delete node;
+        }
     }
 
-    void remove(Item item)
+    bool find(const string &itemName, Item &item)
     {
-        root = removeHelper(root, item);
+        EpochReclaimer::Guard guard(reclaimer);
+        Item *found = get(itemName);
+        if (found)
+            item = *found;
+        return found != nullptr;
     }
 
-    void display() const
+    bool contains(const string &itemName)
     {
-        vector<Item> items;
-        inOrderHelper(root, items);
-        for (const auto &item : items)
-        {
-            item.print();
-        }
+        EpochReclaimer::Guard guard(reclaimer);
+        return get(itemName) != nullptr;
     }
 
-    void displayInOrder(bool ascending = true) const
+    bool add(const Item &item)
     {
-        vector<Item> items;
-        inOrderHelper(root, items);
-        if (!ascending)
-        {
-            sort(items.rbegin(), items.rend());
-        }
-        for (const auto &item : items)
+        EpochReclaimer::Guard guard(reclaimer);
+        for (;;)
         {
-            item.print();
+            Outcome outcome = attemptAdd(item, &rootHolder, 1, rootHolder.version.load());
+            if (outcome == Retry)
+                continue;
+            if (outcome == Changed)
+                countChange(1);
+            return outcome == Changed;
         }
     }
 
-    void displayByPrice(bool ascending = true) const
+    bool remove(const string &itemName)
     {
-        vector<Item> items;
-        inOrderHelper(root, items);
-        if (ascending)
-        {
-            sort(items.begin(), items.end(), [](const Item &a, const Item &b)
-                 { return a.price < b.price; });
-        }
-        else
-        {
-            sort(items.begin(), items.end(), [](const Item &a, const Item &b)
-                 { return a.price > b.price; });
-        }
-        for (const auto &item : items)
+        EpochReclaimer::Guard guard(reclaimer);
+        for (;;)
         {
-            item.print();
+            Outcome outcome = attemptRemove(itemName, &rootHolder, 1, rootHolder.version.load());
+            if (outcome == Retry)
+                continue;
+            if (outcome == Changed)
+                countChange(-1);
+            return outcome == Changed;
         }
     }
+
+    int size() const
+    {
+        long long total = 0;
+        sizeDeltas.forEach([&](const SizeDelta &sizeDelta)
+                           { total += sizeDelta.delta.load(memory_order_relaxed); });
+        return static_cast<int>(total);
+    }
+
+    void display() const
+    {
+        EpochReclaimer::Guard guard(reclaimer);
+        displayHelper(rootHolder.right.load());
+    }
 };
 
 class BSTNode
@@ -359,28 +3648,41 @@ public:
     Item data;
     BSTNode *left;
     BSTNode *right;
+    BSTNode *parent;
 
-    BSTNode(Item item) : data(item), left(nullptr), right(nullptr) {}
+    BSTNode(Item item, BSTNode *parent = nullptr) : data(item), left(nullptr), right(nullptr), parent(parent) {}
 };
 
 class BST
 {
 private:
     BSTNode *root;
+    Finger<BSTNode> finger;
+    NodePool<BSTNode> pool;
+    PriceIndex priceIndex;
+
+    BSTNode *&linkOf(BSTNode *parent, BSTNode *child)
+    {
+        if (!parent)
+            return root;
+        return parent->left == child ? parent->left : parent->right;
+    }
 
-    void addHelper(BSTNode *&node, Item item)
+    BSTNode *addHelper(BSTNode *&node, BSTNode *parent, Item item)
     {
         if (!node)
         {
-            node = new BSTNode(item);
+            node = pool.create(item, parent);
+            priceIndex.insert(&node->data);
+            return node;
         }
         else if (item < node->data)
         {
-            addHelper(node->left, item);
+            return addHelper(node->left, node, item);
         }
         else
         {
-            addHelper(node->right, item);
+            return addHelper(node->right, node, item);
         }
     }
 
@@ -398,20 +3700,25 @@ private:
         }
         else
         {
+            priceIndex.erase(&node->data);
             if (!node->left)
             {
                 BSTNode *temp = node->right;
-                delete node;
+                if (temp)
+                    temp->parent = node->parent;
+                pool.destroy(node);
                 return temp;
             }
             else if (!node->right)
             {
                 BSTNode *temp = node->left;
-                delete node;
+                temp->parent = node->parent;
+                pool.destroy(node);
                 return temp;
             }
             BSTNode *temp = minValueNode(node->right);
             node->data = temp->data;
+            priceIndex.insert(&node->data);
             node->right = removeHelper(node->right, temp->data);
         }
         return node;
@@ -425,34 +3732,82 @@ private:
         return current;
     }
 
-    void inOrderHelper(BSTNode *node, vector<Item> &items) const
+public:
+    typedef TreeIterator<BSTNode> iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    BST() : root(nullptr) {}
+
+    ~BST()
     {
-        if (node)
+        vector<BSTNode *> pending;
+        if (root)
+            pending.push_back(root);
+        while (!pending.empty())
         {
-            inOrderHelper(node->left, items);
-            items.push_back(node->data);
-            inOrderHelper(node->right, items);
+            BSTNode *node = pending.back();
+            pending.pop_back();
+            if (node->left)
+                pending.push_back(node->left);
+            if (node->right)
+                pending.push_back(node->right);
+            pool.destroy(node);
         }
     }
 
-public:
-    BST() : root(nullptr) {}
-
     void addItem(Item item)
     {
-        addHelper(root, item);
+        BSTNode *parent = nullptr, *before = nullptr, *after = nullptr;
+        if (BSTNode **link = finger.adjacentSlot(item, parent, before, after))
+        {
+            finger.moveTo(addHelper(*link, parent, item), before, after);
+            return;
+        }
+
+        BSTNode *start = finger.start(root, item);
+        parent = start ? start->parent : nullptr;
+        finger.moveTo(addHelper(linkOf(parent, start), parent, item));
     }
 
     void remove(Item item)
     {
+        finger.reset();
         root = removeHelper(root, item);
     }
 
+    iterator begin() const
+    {
+        return iterator(leftmost<const BSTNode>(root), &root);
+    }
+
+    iterator end() const
+    {
+        return iterator(nullptr, &root);
+    }
+
+    reverse_iterator rbegin() const
+    {
+        return reverse_iterator(end());
+    }
+
+    reverse_iterator rend() const
+    {
+        return reverse_iterator(begin());
+    }
+
+    iterator lower_bound(const string &itemName) const
+    {
+        return iterator(lowerBoundNode<const BSTNode>(root, itemName, true), &root);
+    }
+
+    iterator upper_bound(const string &itemName) const
+    {
+        return iterator(lowerBoundNode<const BSTNode>(root, itemName, false), &root);
+    }
+
     void display() const
     {
-        vector<Item> items;
-        inOrderHelper(root, items);
-        for (const auto &item : items)
+        for (const auto &item : *this)
         {
             item.print();
         }
@@ -460,45 +3815,36 @@ public:
 
     void displayInOrder(bool ascending = true) const
     {
-        vector<Item> items;
-        inOrderHelper(root, items);
-        if (!ascending)
+        if (ascending)
         {
-            sort(items.rbegin(), items.rend());
+            display();
+            return;
         }
-        for (const auto &item : items)
+        for (auto it = rbegin(); it != rend(); ++it)
         {
-            item.print();
+            it->print();
         }
     }
 
     void displayByPrice(bool ascending = true) const
     {
-        vector<Item> items;
-        inOrderHelper(root, items);
-        if (ascending)
-        {
-            sort(items.begin(), items.end(), [](const Item &a, const Item &b)
-                 { return a.price < b.price; });
-        }
-        else
-        {
-            sort(items.begin(), items.end(), [](const Item &a, const Item &b)
-                 { return a.price > b.price; });
-        }
-        for (const auto &item : items)
-        {
-            item.print();
-        }
+        printPriceIndex(priceIndex, ascending);
+    }
+
+    void displayPriceRange(int loPrice, int hiPrice) const
+    {
+        printPriceRange(priceIndex, loPrice, hiPrice);
     }
 };
 
-void readItems(istream &input, BST &tree)
+vector<Item> readItemList(istream &input)
 {
     int numItems;
     input >> numItems;
     input.ignore();
 
+    vector<Item> items;
+    items.reserve(numItems);
     for (int i = 0; i < numItems; ++i)
     {
         string itemName, category;
@@ -509,48 +3855,28 @@ void readItems(istream &input, BST &tree)
         input >> price;
         input.ignore();
 
-        tree.addItem(Item(itemName, category, price));
+        items.push_back(Item(std::move(itemName), std::move(category), price));
     }
+    return items;
 }
 
-void readItems(istream &input, Heap &heap)
+template <class Container>
+void readItems(istream &input, Container &heap)
 {
-    int numItems;
-    input >> numItems;
-    input.ignore();
-
-    for (int i = 0; i < numItems; ++i)
-    {
-        string itemName, category;
-        int price;
-
-        getline(input, itemName);
-        getline(input, category);
-        input >> price;
-        input.ignore();
-
-        heap.add(Item(itemName, category, price));
-    }
+    vector<Item> items = readItemList(input);
+    heap.reserve(heap.size() + items.size());
+    heap.buildFrom(make_move_iterator(items.begin()), make_move_iterator(items.end()));
 }
 
 void readItems(istream &input, AVL &tree)
 {
-    int numItems;
-    input >> numItems;
-    input.ignore();
-
-    for (int i = 0; i < numItems; ++i)
-    {
-        string itemName, category;
-        int price;
-
-        getline(input, itemName);
-        getline(input, category);
-        input >> price;
-        input.ignore();
+    tree.buildFrom(readItemList(input));
+}
 
-        tree.add(Item(itemName, category, price));
-    }
+void readItems(istream &input, BST &tree)
+{
+    for (Item &item : readItemList(input))
+        tree.addItem(std::move(item));
 }
 
 void Menu()
@@ -576,11 +3902,11 @@ void TreeMenu()
     cout << "Your choice: ";
 }
 
+#ifndef ASSIGNMENT_NO_MAIN
 int main()
 {
     BST bst;
-    Heap minHeap(true);
-    Heap maxHeap(false);
+    MinMaxHeap<ByName> heap;
     AVL avl;
     int mainChoice, treeChoice;
     string itemName, category;
@@ -658,52 +3984,28 @@ int main()
                     getline(cin, category);
                     cout << "Enter price: ";
                     cin >> price;
-                    if (minHeap.isMinHeap)
-                        minHeap.add(Item(itemName, category, price));
-                    else
-                        maxHeap.add(Item(itemName, category, price));
+                    heap.add(Item(itemName, category, price));
                     break;
                 case 2:
-                    if (minHeap.isMinHeap)
-                        minHeap.remove();
-                    else
-                        maxHeap.remove();
+                    heap.popMin();
                     break;
                 case 3:
-                    if (minHeap.isMinHeap)
-                        minHeap.display();
-                    else
-                        maxHeap.display();
+                    heap.display();
                     break;
                 case 4:
-                    if (minHeap.isMinHeap)
-                        minHeap.heapSortBy(true, true);
-                    else
-                        maxHeap.heapSortBy(true, true);
+                    heap.heapSortBy(true, true);
+                    break;
+                case 5:
+                    heap.heapSortBy(true, false);
+                    break;
+                case 6:
+                    heap.heapSortBy(false, true);
                     break;
-                    case 5:
-                        if(minHeap.isMinHeap)
-                            minHeap.heapSortBy(true, false);
-                        else
-                            maxHeap.heapSortBy(true, false);
-                        break;
-                    case 6:
-                        if(minHeap.isMinHeap)
-                            minHeap.heapSortBy(false, true);
-                        else
-                            maxHeap.heapSortBy(false, true);
+                case 7:
+                    heap.heapSortBy(false, false);
                     break;
-                    case 7:
-                        if(minHeap.isMinHeap)
-                            minHeap.heapSortBy(false, false);
-                        else
-                            maxHeap.heapSortBy(false, false);
-                        break;
                 case 8:
-                    if (minHeap.isMinHeap)
-                        readItems(inFile, minHeap);
-                    else
-                        readItems(inFile, maxHeap);
+                    readItems(inFile, heap);
                     break;
                 }
             } while (treeChoice != 9);
@@ -756,3 +4058,4 @@ int main()
 
     return 0;
 }
+#endif